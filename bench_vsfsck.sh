@@ -0,0 +1,113 @@
+#!/bin/sh
+# Times every vsfsck phase (load, walk, each check_* and fix_errors()) on
+# images made by mkvsfs, clean and with every kind of corruption, across
+# image sizes. Each case runs on a freshly generated image and the fastest
+# run is kept. Results go to bench_output.txt, one line per
+# size/case/pass/phase with wall and CPU milliseconds. With -b, every line is
+# compared against a baseline written earlier with -o.
+#
+#   ./bench_vsfsck.sh [-r runs] [-j threads] [-s "blocks ..."] [-b baseline] [-o file] [-- vsfsck options]
+
+set -e
+
+runs=3
+threads=1
+sizes="64 16384 262144"
+baseline=
+output=bench_output.txt
+slower=1.20     # ratio to the baseline reported as slower
+noise=0.5       # ms, smaller differences are never reported
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+    -r) runs=$2; shift 2 ;;
+    -j) threads=$2; shift 2 ;;
+    -s) sizes=$2; shift 2 ;;
+    -b) baseline=$2; shift 2 ;;
+    -o) output=$2; shift 2 ;;
+    --) shift; break ;;
+    *) echo "Usage: $0 [-r runs] [-j threads] [-s \"blocks ...\"] [-b baseline] [-o file] [-- vsfsck options]" >&2
+       exit 1 ;;
+    esac
+done
+
+src=$(cd "$(dirname "$0")" && pwd)
+case "$output" in /*) ;; *) output="$PWD/$output" ;; esac
+case "$baseline" in /*|"") ;; *) baseline="$PWD/$baseline" ;; esac
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc -O2 -pthread -o "$work/vsfsck" "$src/vsfsck_project2.c"
+gcc -O2 -o "$work/mkvsfs" "$src/mkvsfs.c"
+cd "$work"
+
+# Prints "pass phase wall_ms cpu_ms" for every phase of a JSON report
+phases() {
+    awk '{
+        n = split($0, passes, /\{"pass":"/)
+        for (i = 2; i <= n; i++) {
+            pass = substr(passes[i], 1, index(passes[i], "\"") - 1)
+            rest = passes[i]
+            while (match(rest, /"phase":"[a-z_]+","wall_ms":[0-9.]+,"cpu_ms":[0-9.]+/)) {
+                split(substr(rest, RSTART, RLENGTH), f, /[":,]+/)
+                print pass, f[3], f[5], f[7]
+                rest = substr(rest, RSTART + RLENGTH)
+            }
+        }
+    }'
+}
+
+: > raw.txt
+for blocks in $sizes; do
+    # Deep files need room for their triple indirect trees
+    deep=0
+    [ "$blocks" -ge 8192 ] && deep=4
+    for case in clean corrupt; do
+        corrupt=
+        [ $case = corrupt ] && corrupt="-c all"
+        run=1
+        while [ $run -le "$runs" ]; do
+            rm -f vsfs.img vsfs.img.journal
+            ./mkvsfs -b "$blocks" -d $deep -s "$blocks" $corrupt vsfs.img > mkvsfs.log ||
+                { cat mkvsfs.log >&2; exit 1; }
+            # 4: errors left, e.g. a full image with no room to copy duplicates
+            ./vsfsck --format=json -j "$threads" "$@" > report.json || [ $? -eq 4 ]
+            phases < report.json | sed "s/^/$blocks $case /" >> raw.txt
+            run=$((run + 1))
+        done
+    done
+done
+
+# Fastest run of every phase
+awk '{
+    key = $1 " " $2 " " $3 " " $4
+    if (!(key in wall) || $5 < wall[key]) { wall[key] = $5; cpu[key] = $6 }
+    if (!(key in order)) { order[key] = ++count; keys[count] = key }
+} END {
+    for (k = 1; k <= count; k++) printf "%s %.3f %.3f\n", keys[k], wall[keys[k]], cpu[keys[k]]
+}' raw.txt > best.txt
+
+{
+    echo "# vsfsck phases, fastest of $runs runs, -j $threads: blocks case pass phase wall_ms cpu_ms"
+    cat best.txt
+} > "$output"
+
+if [ -z "$baseline" ]; then
+    cat "$output"
+    exit 0
+fi
+
+# Side by side with the baseline, slower phases flagged
+awk -v slower=$slower -v noise=$noise '
+    FNR == NR { if ($0 !~ /^#/) base[$1 " " $2 " " $3 " " $4] = $5; next }
+    /^#/ { next }
+    {
+        key = $1 " " $2 " " $3 " " $4
+        if (!(key in base)) { printf "%-40s %10s %10.3f\n", key, "-", $5; next }
+        flag = ""
+        if ($5 > base[key] * slower && $5 - base[key] > noise) { flag = "  SLOWER"; regressions++ }
+        printf "%-40s %10.3f %10.3f %6.2fx%s\n", key, base[key], $5, (base[key] > 0 ? $5 / base[key] : 1), flag
+    }
+    END {
+        if (regressions) { printf "%d phases slower than the baseline\n", regressions; exit 2 }
+    }' "$baseline" "$output"
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pipe2, getline
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,29 +9,215 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <ctype.h>
+#include <errno.h>
+#include <spawn.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <termios.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 
-#define MAX_VAL 275
-#define MAX_ARGS 50
-#define HISTORY_SIZE 100
+extern char **environ;
 
+// glibc 2.35 can hand the terminal to a spawned process group itself
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define HAVE_SPAWN_TCSETPGRP 1
+#endif
+
+// waitid() on a pidfd, only <linux/wait.h> names it
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+#define HISTORY_SIZE 1000 // entries kept when HISTSIZE is not set
+#define HASH_BUCKETS 64
+#define ARENA_CHUNK 4096
+#define MAX_JOBS 64
+#define STATS_SIZE 256 // commands kept for the stats builtin
+
+
+// Memory for parsed commands. A line or a whole script is parsed into one
+// arena and everything is released together with arena_free.
+typedef struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t used;
+    size_t size;
+    char data[];
+} arena_chunk;
+
+typedef struct {
+    arena_chunk *top;
+} arena_t;
+
+// One command of a pipeline with its redirections
+typedef struct {
+    char **args; // NULL terminated
+    int input_redir;
+    char *input_file;
+    int output_redir; // 1 for >, 2 for >>
+    char *output_file;
+    int error_redir;  // 1 for 2>, 2 for 2>>
+    char *error_file;
+} command_node;
+
+#define CONNECT_SEQ 0 // ; or start of line, always runs
+#define CONNECT_AND 1 // &&, runs only if the status so far is 0
+#define CONNECT_OR 2  // ||, runs only if the status so far is not 0
+
+// Token kinds the lexer produces
+enum {
+    TOK_WORD,
+    TOK_PIPE,       // |
+    TOK_AND,        // &&
+    TOK_OR,         // ||
+    TOK_SEMI,       // ;
+    TOK_IN,         // <
+    TOK_OUT,        // >
+    TOK_APPEND,     // >>
+    TOK_ERR,        // 2>
+    TOK_ERR_APPEND, // 2>>
+    TOK_BG          // &
+};
+
+// A token is a span of the line being parsed, the lexer copies nothing
+typedef struct {
+    int type;
+    bool quoted; // word has quotes or backslashes still to be removed
+    char *start;
+    int len;
+} token_t;
+
+// Commands joined with |, and how the pipeline joins the one before it
+typedef struct {
+    command_node *stages;
+    int count;
+    int connector;
+    bool background; // ended by &
+    bool timed;      // prefixed with time
+} pipeline_node;
+
+// One line: pipelines joined with ; and &&
+typedef struct list_node {
+    pipeline_node *items;
+    int count;
+    struct list_node *next; // next line of a script
+} list_node;
+
+// A pipeline or background list the shell started. The SIGCHLD handler
+// reaps background and stopped jobs, wait_for_job reaps the foreground one.
+typedef struct {
+    int id;          // %N, 0 for a free slot
+    pid_t pgid;      // process group when there is job control
+    pid_t *pids;     // -1 for a command that did not start
+    int *codes;      // exit code of each process, -1 while it runs
+    int count;
+    int live;        // processes that have not exited
+    bool stopped;
+    bool background;
+    char *command;   // text shown by jobs
+    // Only for a job that is timed or logged to stats
+    bool timed;
+    struct timespec started;
+    char **stages;          // text of each process
+    struct rusage *usage;   // from wait4
+    double *seconds;        // from the start until each process exited
+} job_t;
+
+// Resource use of one finished command or pipeline stage
+typedef struct {
+    time_t when; // finished
+    char *command;
+    int code;
+    double real;
+    double user;
+    double sys;
+    long max_rss;     // KiB
+    long voluntary;   // context switches
+    long involuntary;
+} stats_entry;
 
 void handle_sigint(int sig);
-void show_history(void);
-void parse_input(char *inp, char *args[], int *input_redir, char **input_file,  int *output_redir, char **output_file);
-void execute_with_redirection(char *args[], int input_redir, char *input_file,int output_redir, char *output_file);
+void show_history(int count);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *str);
+void arena_free(arena_t *arena);
+int lex_line(char *line, token_t *tokens);
+char *word_text(token_t *token);
+bool parse_command(arena_t *arena, token_t *tokens, int *pos, int count, command_node *cmd);
+list_node *parse_line(arena_t *arena, char *line);
+list_node *parse_script(arena_t *arena, char *text, bool *ok);
+int run_pipeline(pipeline_node *pipeline, bool background);
+int run_list(list_node *list);
+int run_script(char *text);
+int execute_with_redirection(command_node *cmd);
+int open_redirections(command_node *cmd, int *in_fd, int *out_fd, int *err_fd);
+const char *find_command(const char *name, bool *hashed);
+void forget_command(const char *name);
+void clear_hash(void);
+void show_hash(void);
+pid_t spawn_command(char *args[], int in_fd, int out_fd, int err_fd, pid_t pgid, bool take_terminal);
+pid_t fork_builtin(char *args[], int in_fd, int out_fd, int err_fd, pid_t pgid, bool take_terminal);
+bool is_builtin(const char *name);
 int builtin_command(char *args[]);
-int handle_redirections(char *args[]);
-void external_command(char *args[]);
 void compact_args(char *args[]);
-void remove_space(char *str);
-int piping(char *inp);
 void take_input(char *inp);
 void add_to_history(const char *command);
-void show_history(void);
+void load_history(void);
+char *expand_history(const char *line);
+long search_history(const char *query, int len, long before);
+char *read_line(const char *prompt);
+void show_history(int count);
+int exit_code(int status);
+void handle_sigchld(int sig);
+void start_job_control(void);
+job_t *find_job(const char *builtin, const char *spec);
+int continue_job(job_t *job, bool foreground);
+int wait_for_job(job_t *job);
+int wait_jobs(const char *spec);
+void list_jobs(void);
+void report_jobs(void);
+double seconds_since(struct timespec *start);
+void describe_command(FILE *out, command_node *cmd);
+void record_stats(const char *command, int code, double real, struct rusage *usage);
+void show_stats(int count, bool json);
+int parallel_builtin(char *args[]);
+
+bool pipefail = false; // set -o pipefail: a pipeline fails if any stage fails
+bool stats_mode = false; // set -o stats: log every command's resource use
+int last_status = 0;   // exit code of the last pipeline, the exit code of a script
+int builtin_status = 0; // exit code of the last builtin
+volatile sig_atomic_t interrupted = 0; // Ctrl+C arrived
+
+// Where each command was found on PATH, like bash's hash table. Filled the
+// first time a command runs, emptied by hash -r or when PATH changes.
+typedef struct hash_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct hash_entry *next;
+} hash_entry;
+
+hash_entry *command_hash[HASH_BUCKETS];
+char *hashed_for_path = NULL; // PATH the table was filled from
+char *uncached_path = NULL;   // found when there was no memory to add it, kept until the next lookup
+
+job_t jobs[MAX_JOBS];
+bool job_control = false; // interactive on a terminal: process groups, fg and bg
+pid_t shell_pgid;
+
+stats_entry stats_log[STATS_SIZE]; // ring of the last STATS_SIZE commands
+long stats_total = 0; // commands ever logged
 
 
 // Signal handler for SIGINT (Ctrl+C)
 void handle_sigint(int sig) {
+    interrupted = 1;
     write(STDOUT_FILENO, "\n^C (command cancelled)\n", 25);
     
     
@@ -41,93 +228,606 @@ void handle_sigint(int sig) {
 }
 
 // Function to show history of commands
-void show_history(void);
+void show_history(int count);
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (arena->top == NULL || arena->top->size - arena->top->used < size) {
+        size_t chunk = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        arena_chunk *c = malloc(sizeof(arena_chunk) + chunk);
+        if (c == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        c->prev = arena->top;
+        c->used = 0;
+        c->size = chunk;
+        arena->top = c;
+    }
+    void *p = arena->top->data + arena->top->used;
+    arena->top->used += size;
+    return p;
+}
+
+char *arena_strdup(arena_t *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, len), str, len);
+}
+
+void arena_free(arena_t *arena) {
+    while (arena->top != NULL) {
+        arena_chunk *c = arena->top;
+        arena->top = c->prev;
+        free(c);
+    }
+}
+
+int script_line = 0; // line being parsed, 0 when interactive
+
+void error_prefix(void) {
+    if (script_line > 0) {
+        fprintf(stderr, "siu: line %d: ", script_line);
+    } else {
+        fprintf(stderr, "siu: ");
+    }
+}
 
-// Function to parse the input into arguments
-void parse_input(char *inp, char *args[], int *input_redir, char **input_file, 
-                int *output_redir, char **output_file) {
-    *input_redir = 0;
-    *output_redir = 0;
-    *input_file = NULL;
-    *output_file = NULL;
+// Operators are spelled from their kind, since word_text may have put a
+// word's terminator on the first character of an operator right after it
+void syntax_error(token_t *near) {
+    static const char *op_text[] = { NULL, "|", "&&", "||", ";", "<", ">", ">>", "2>", "2>>", "&" };
+    error_prefix();
+    if (near != NULL && near->type != TOK_WORD) {
+        fprintf(stderr, "syntax error near unexpected token `%s'\n", op_text[near->type]);
+    } else if (near != NULL) {
+        fprintf(stderr, "syntax error near unexpected token `%.*s'\n", near->len, near->start);
+    } else {
+        fprintf(stderr, "syntax error near unexpected token `newline'\n");
+    }
+}
+
+// Splits a line into tokens in one pass. Tokens are spans of the line, so
+// nothing is copied. A line of n characters has at most n tokens.
+// Returns the token count, or -1 after reporting a syntax error.
+int lex_line(char *line, token_t *tokens) {
+    int n = 0;
+    char *p = line;
+
+    while (true) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0' || *p == '#') {
+            break; // # at the start of a word begins a comment
+        }
+
+        token_t *t = &tokens[n++];
+        t->start = p;
+        t->quoted = false;
+        if (*p == '|') {
+            t->type = p[1] == '|' ? TOK_OR : TOK_PIPE;
+        } else if (*p == '&' && p[1] == '&') {
+            t->type = TOK_AND;
+        } else if (*p == ';') {
+            t->type = TOK_SEMI;
+        } else if (*p == '<') {
+            t->type = TOK_IN;
+        } else if (*p == '>') {
+            t->type = p[1] == '>' ? TOK_APPEND : TOK_OUT;
+        } else if (*p == '2' && p[1] == '>') {
+            t->type = p[2] == '>' ? TOK_ERR_APPEND : TOK_ERR;
+        } else if (*p == '&') {
+            t->type = TOK_BG;
+        } else {
+            // A word runs to the next unquoted blank or operator
+            char quote = 0;
+            for (; *p; p++) {
+                if (quote) {
+                    if (*p == quote) quote = 0;
+                    else if (quote == '"' && *p == '\\' && p[1]) p++;
+                } else if (*p == ' ' || *p == '\t' || strchr("|&;<>", *p)) {
+                    break;
+                } else if (*p == '\'' || *p == '"') {
+                    quote = *p;
+                    t->quoted = true;
+                } else if (*p == '\\' && p[1]) {
+                    p++;
+                    t->quoted = true;
+                }
+            }
+            if (quote) {
+                error_prefix();
+                fprintf(stderr, "unexpected end of line while looking for matching `%c'\n", quote);
+                return -1;
+            }
+            t->type = TOK_WORD;
+            t->len = p - t->start;
+            continue;
+        }
+
+        static const int op_len[] = { 0, 1, 2, 2, 1, 1, 1, 2, 2, 3, 1 };
+        t->len = op_len[t->type];
+        p += t->len;
+    }
+    return n;
+}
+
+// Makes a word token a C string where it stands. Quotes and backslashes are
+// removed by moving the characters left, and the terminator goes on the
+// character after the word, which the lexer is already done with. That can
+// be the first character of an operator, whose kind the token keeps.
+char *word_text(token_t *token) {
+    char *src = token->start;
+    char *end = token->start + token->len;
+    char *dst = token->start;
+    if (!token->quoted) {
+        *end = '\0';
+        return token->start;
+    }
+
+    char quote = 0;
+    for (; src < end; src++) {
+        if (quote) {
+            if (*src == quote) {
+                quote = 0;
+            } else if (quote == '"' && *src == '\\' && src + 1 < end && strchr("\"\\$`", src[1])) {
+                *dst++ = *++src;
+            } else {
+                *dst++ = *src;
+            }
+        } else if (*src == '\'' || *src == '"') {
+            quote = *src;
+        } else if (*src == '\\' && src + 1 < end) {
+            *dst++ = *++src;
+        } else {
+            *dst++ = *src;
+        }
+    }
+    *dst = '\0';
+    return token->start;
+}
+
+// Parses one command of a pipeline starting at tokens[*pos], leaves *pos on
+// the token that ended it
+bool parse_command(arena_t *arena, token_t *tokens, int *pos, int count, command_node *cmd) {
+    cmd->input_redir = 0;
+    cmd->output_redir = 0;
+    cmd->error_redir = 0;
+    cmd->input_file = NULL;
+    cmd->output_file = NULL;
+    cmd->error_file = NULL;
+
+    int end = *pos;
+    while (end < count && tokens[end].type != TOK_PIPE && tokens[end].type != TOK_AND &&
+           tokens[end].type != TOK_OR && tokens[end].type != TOK_SEMI && tokens[end].type != TOK_BG) {
+        end++;
+    }
+    cmd->args = arena_alloc(arena, (end - *pos + 1) * sizeof(char *));
 
-    char *token = strtok(inp, " ");
     int i = 0;
-    
-    while (token != NULL) {
-        if (strcmp(token, "<") == 0) {
-            *input_redir = 1;
-            token = strtok(NULL, " ");
-            if (token) *input_file = token;
-        } 
-        else if (strcmp(token, ">") == 0) {
-            *output_redir = 1; 
-            token = strtok(NULL, " ");
-            if (token) *output_file = token;
+    bool redirected = false;
+    for (int t = *pos; t < end; t++) {
+        int type = tokens[t].type;
+        if (type == TOK_WORD) {
+            cmd->args[i++] = word_text(&tokens[t]);
+            continue;
         }
-        else if (strcmp(token, ">>") == 0) {
-            *output_redir = 2; // 2 for append
-            token = strtok(NULL, " ");
-            if (token) *output_file = token;
+        // Every redirection needs a file name after it
+        if (t + 1 >= end || tokens[t + 1].type != TOK_WORD) {
+            syntax_error(t + 1 < count ? &tokens[t + 1] : NULL);
+            return false;
         }
-        else {
-            args[i++] = token;
+        char *file = word_text(&tokens[++t]);
+        redirected = true;
+        if (type == TOK_IN) {
+            cmd->input_redir = 1;
+            cmd->input_file = file;
+        } else if (type == TOK_OUT || type == TOK_APPEND) {
+            cmd->output_redir = type == TOK_APPEND ? 2 : 1;
+            cmd->output_file = file;
+        } else {
+            cmd->error_redir = type == TOK_ERR_APPEND ? 2 : 1;
+            cmd->error_file = file;
         }
-        token = strtok(NULL, " ");
     }
-    args[i] = NULL;
+    cmd->args[i] = NULL;
+    *pos = end;
+
+    if (i == 0 && !redirected) {
+        syntax_error(end < count ? &tokens[end] : NULL);
+        return false;
+    }
+    return true;
 }
 
-void execute_with_redirection(char *args[], int input_redir, char *input_file,
-                            int output_redir, char *output_file) {
+// Parses one line into its list of pipelines joined by ;, && and ||. The
+// line is tokenized in place and the tree points into it, so it has to live
+// as long as the tree. Returns NULL after a syntax error.
+list_node *parse_line(arena_t *arena, char *line) {
+    token_t *tokens = arena_alloc(arena, (strlen(line) + 1) * sizeof(token_t));
+    int count = lex_line(line, tokens);
+    if (count < 0) {
+        return NULL;
+    }
+
+    int joins = 0;
+    for (int t = 0; t < count; t++) {
+        if (tokens[t].type == TOK_SEMI || tokens[t].type == TOK_AND || tokens[t].type == TOK_OR ||
+            tokens[t].type == TOK_BG) joins++;
+    }
+    list_node *list = arena_alloc(arena, sizeof(list_node));
+    list->items = arena_alloc(arena, (joins + 1) * sizeof(pipeline_node));
+    list->count = 0;
+    list->next = NULL;
+
+    int pos = 0;
+    int connector = CONNECT_SEQ;
+    while (pos < count) {
+        if (tokens[pos].type == TOK_SEMI && connector == CONNECT_SEQ) {
+            pos++; // Empty command between two ;
+            continue;
+        }
+
+        int pipes = 0;
+        for (int t = pos; t < count && tokens[t].type != TOK_AND && tokens[t].type != TOK_OR &&
+                          tokens[t].type != TOK_SEMI && tokens[t].type != TOK_BG; t++) {
+            if (tokens[t].type == TOK_PIPE) pipes++;
+        }
+        pipeline_node *pipeline = &list->items[list->count++];
+        pipeline->connector = connector;
+        pipeline->background = false;
+        pipeline->timed = false;
+        if (pos + 1 < count && tokens[pos].type == TOK_WORD && !tokens[pos].quoted &&
+            tokens[pos].len == 4 && strncmp(tokens[pos].start, "time", 4) == 0 &&
+            tokens[pos + 1].type == TOK_WORD) {
+            pipeline->timed = true; // time pipeline
+            pos++;
+        }
+        pipeline->stages = arena_alloc(arena, (pipes + 1) * sizeof(command_node));
+        pipeline->count = 0;
+
+        while (true) {
+            if (!parse_command(arena, tokens, &pos, count, &pipeline->stages[pipeline->count++])) {
+                return NULL;
+            }
+            if (pos < count && tokens[pos].type == TOK_PIPE) {
+                pos++;
+                continue;
+            }
+            break;
+        }
+
+        connector = CONNECT_SEQ;
+        if (pos < count) {
+            if (tokens[pos].type == TOK_AND) connector = CONNECT_AND;
+            else if (tokens[pos].type == TOK_OR) connector = CONNECT_OR;
+            else if (tokens[pos].type == TOK_BG) pipeline->background = true; // the list so far
+            pos++;
+        }
+    }
+    if (connector != CONNECT_SEQ) {
+        syntax_error(NULL); // Line ends in && or ||
+        return NULL;
+    }
+    return list;
+}
+
+// Parses a whole script before any of it runs, in place in text. Blank lines
+// and # comments, including a #! line, parse to empty lists. *ok is false
+// if any line has a syntax error.
+list_node *parse_script(arena_t *arena, char *text, bool *ok) {
+    list_node *head = NULL;
+    list_node **tail = &head;
+    *ok = true;
+
+    char *line = text;
+    for (script_line = 1; line != NULL; script_line++) {
+        char *newline = strchr(line, '\n');
+        if (newline != NULL) *newline = '\0';
+
+        list_node *list = parse_line(arena, line);
+        if (list == NULL) {
+            *ok = false;
+        } else if (list->count > 0) {
+            *tail = list;
+            tail = &list->next;
+        }
+        line = newline ? newline + 1 : NULL;
+    }
+    script_line = 0;
+    return head;
+}
+
+// Opens the <, > / >> and 2> / 2>> files of a command, close-on-exec so only
+// the command they are handed to keeps them. Unused ones are left at -1.
+int open_redirections(command_node *cmd, int *in_fd, int *out_fd, int *err_fd) {
+    *in_fd = -1;
+    *out_fd = -1;
+    *err_fd = -1;
+
+    // Handle input redirection
+    if (cmd->input_redir && cmd->input_file) {
+        *in_fd = open(cmd->input_file, O_RDONLY | O_CLOEXEC); // <
+        if (*in_fd < 0) {
+            perror("open input file");
+            return -1;
+        }
+    }
+
+    // Handle output and error redirection
+    int redir[2] = { cmd->output_redir, cmd->error_redir };
+    char *file[2] = { cmd->output_file, cmd->error_file };
+    int *fd[2] = { out_fd, err_fd };
+    for (int i = 0; i < 2; i++) {
+        if (!redir[i] || !file[i]) {
+            continue;
+        }
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        if (redir[i] == 2) flags |= O_APPEND;  // >>
+        else flags |= O_TRUNC;                 // >
+
+        *fd[i] = open(file[i], flags, 0644);
+        if (*fd[i] < 0) {
+            perror(i == 0 ? "open output file" : "open error file");
+            if (*in_fd != -1) close(*in_fd);
+            if (*out_fd != -1) close(*out_fd);
+            *in_fd = *out_fd = *err_fd = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+unsigned hash_name(const char *name) {
+    unsigned h = 5381;
+    while (*name) h = h * 33 + (unsigned char)*name++;
+    return h % HASH_BUCKETS;
+}
+
+void clear_hash(void) {
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        while (command_hash[i] != NULL) {
+            hash_entry *e = command_hash[i];
+            command_hash[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+}
+
+// Drops one command, e.g. when its binary is gone from where it was found
+void forget_command(const char *name) {
+    hash_entry **link = &command_hash[hash_name(name)];
+    while (*link != NULL) {
+        hash_entry *e = *link;
+        if (strcmp(e->name, name) == 0) {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+        link = &e->next;
+    }
+}
+
+// Searches the PATH directories for an executable regular file
+char *search_path(const char *name, const char *path) {
+    char candidate[PATH_MAX];
+    const char *dir = path;
+    while (dir != NULL) {
+        const char *end = strchr(dir, ':');
+        size_t len = end ? (size_t)(end - dir) : strlen(dir);
+        // An empty PATH entry means the current directory
+        int n = len == 0 ? snprintf(candidate, sizeof(candidate), "./%s", name)
+                         : snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, dir, name);
+        struct stat st;
+        if (n > 0 && (size_t)n < sizeof(candidate) && stat(candidate, &st) == 0 &&
+            S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return strdup(candidate);
+        }
+        dir = end ? end + 1 : NULL;
+    }
+    return NULL;
+}
+
+// Resolves a command name to the file to run. Names with a slash are used
+// as they are. *hashed tells if the answer came from the table.
+const char *find_command(const char *name, bool *hashed) {
+    *hashed = false;
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    const char *path = getenv("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
+    if (hashed_for_path == NULL || strcmp(hashed_for_path, path) != 0) {
+        clear_hash();
+        free(hashed_for_path);
+        hashed_for_path = strdup(path);
+    }
+
+    unsigned b = hash_name(name);
+    for (hash_entry *e = command_hash[b]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            *hashed = true;
+            return e->path;
+        }
+    }
+
+    char *found = search_path(name, path);
+    if (found == NULL) {
+        return NULL;
+    }
+    hash_entry *e = malloc(sizeof(hash_entry));
+    char *copy = strdup(name);
+    if (e == NULL || copy == NULL) {
+        // Out of memory: run it this time without remembering it
+        free(e);
+        free(copy);
+        free(uncached_path);
+        uncached_path = found;
+        return found;
+    }
+    e->name = copy;
+    e->path = found;
+    e->hits = 1;
+    e->next = command_hash[b];
+    command_hash[b] = e;
+    return e->path;
+}
+
+// hash builtin listing, same layout as bash
+void show_hash(void) {
+    bool any = false;
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        for (hash_entry *e = command_hash[i]; e != NULL; e = e->next) {
+            if (!any) printf("hits\tcommand\n");
+            any = true;
+            printf("%4d\t%s\n", e->hits, e->path);
+        }
+    }
+    if (!any) printf("hash: hash table empty\n");
+}
+
+// Starts an external command with posix_spawn, which does not copy the
+// shell's page tables the way fork does. in_fd becomes its stdin, out_fd its
+// stdout and err_fd its stderr, unless they are -1. Unless pgid is -1 the
+// command goes into process group pgid, or a new one if it is 0, and with
+// take_terminal that group gets the terminal. Returns the pid, or -1 if it
+// did not start.
+pid_t spawn_command(char *args[], int in_fd, int out_fd, int err_fd, pid_t pgid, bool take_terminal) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    if (in_fd != -1 && in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1 && out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    if (err_fd != -1 && err_fd != STDERR_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+    }
+
+    // Ctrl+C, Ctrl+Z and the rest have to reach the command, not the
+    // shell's handlers, and nothing the shell blocks stays blocked
+    sigset_t defaults, mask;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGCHLD);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (pgid != -1) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+#ifdef HAVE_SPAWN_TCSETPGRP
+    if (take_terminal) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+#else
+    (void)take_terminal; // the shell hands the terminal over after the spawn
+#endif
+
+    // Spawn the resolved file directly instead of letting execvp try every
+    // PATH directory. A hashed file that has gone away is looked up again.
+    pid_t pid = -1;
+    int err;
+    bool hashed;
+    fflush(stdout); // keep the shell's own output ahead of the command's
+    const char *file = find_command(args[0], &hashed);
+    if (file == NULL) {
+        err = ENOENT;
+    } else {
+        err = posix_spawn(&pid, file, &actions, &attr, args, environ);
+        if (err == ENOENT && hashed) {
+            forget_command(args[0]);
+            file = find_command(args[0], &hashed);
+            if (file != NULL) {
+                err = posix_spawn(&pid, file, &actions, &attr, args, environ);
+            }
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (file == NULL) {
+        fprintf(stderr, "%s: command not found\n", args[0]);
+        return -1;
+    }
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", args[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+// A builtin inside a pipeline or in the background has to run in its own
+// process, this is the one place the shell still forks
+pid_t fork_builtin(char *args[], int in_fd, int out_fd, int err_fd, pid_t pgid, bool take_terminal) {
+    fflush(stdout);
     pid_t pid = fork();
-    
     if (pid == 0) {
-        // Handle input redirection
-        if (input_redir && input_file) {
-            int fd = open(input_file, O_RDONLY); // <
-            if (fd < 0) {
-                perror("open input file");
-                exit(1);
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-        }
-        
-        // Handle output redirection
-        if (output_redir && output_file) {
-            int fd;
-            if (output_redir == 2) {
-                fd = open(output_file, O_WRONLY | O_CREAT | O_APPEND, 0644); // >>
-            }
-            else {
-                fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644); // >
-                         
-            }
-            
-            if (fd < 0) {
-                perror("Output file error");
-                exit(1);
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-        }
-        
-        // Execute the command
-        execvp(args[0], args);
-        perror("execvp failed");
-        exit(1);
-    } 
-    else if (pid > 0) {
-        wait(NULL);
-    } 
-    else {
+        if (pgid != -1) setpgid(0, pgid);
+        if (take_terminal) tcsetpgrp(STDIN_FILENO, getpgrp());
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        if (in_fd != -1 && in_fd != STDIN_FILENO) dup2(in_fd, STDIN_FILENO);
+        if (out_fd != -1 && out_fd != STDOUT_FILENO) dup2(out_fd, STDOUT_FILENO);
+        if (err_fd != -1 && err_fd != STDERR_FILENO) dup2(err_fd, STDERR_FILENO);
+        builtin_command(args);
+        fflush(stdout);
+        _exit(builtin_status);
+    } else if (pid < 0) {
         perror("fork failed");
     }
+    return pid;
+}
+
+// Runs one command with its redirections and waits for it, returns its exit code
+int execute_with_redirection(command_node *cmd) {
+    int in_fd, out_fd, err_fd;
+    if (open_redirections(cmd, &in_fd, &out_fd, &err_fd) != 0) {
+        return 1;
+    }
+
+    pid_t pid = spawn_command(cmd->args, in_fd, out_fd, err_fd, -1, false);
+    if (in_fd != -1) close(in_fd);
+    if (out_fd != -1) close(out_fd);
+    if (err_fd != -1) close(err_fd);
+    if (pid < 0) {
+        return 127;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        return 1;
+    }
+    return exit_code(status);
 }
 
 // Handling built-in commands
 int builtin_command(char *args[]) {
+    builtin_status = 0;
+    if (args[0] == NULL) {
+        return 0; // Only redirections, run_pipeline opens the files
+    }
     if (strcmp(args[0], "cd") == 0) {
         if (args[1] == NULL) {
             printf("cd: expected argument\n");
@@ -141,333 +841,1557 @@ int builtin_command(char *args[]) {
     } else if (strcmp(args[0], "exit") == 0) {
         exit(0); // Exits the shell
     } else if (strcmp(args[0], "history") == 0) {
-        show_history();
+        show_history(args[1] != NULL ? atoi(args[1]) : 0);
+        return 1;
+    } else if (strcmp(args[0], "set") == 0) {
+        if (args[1] != NULL && args[2] != NULL && strcmp(args[2], "pipefail") == 0 &&
+            (strcmp(args[1], "-o") == 0 || strcmp(args[1], "+o") == 0)) {
+            pipefail = (args[1][0] == '-');
+        } else if (args[1] != NULL && args[2] != NULL && strcmp(args[2], "stats") == 0 &&
+                   (strcmp(args[1], "-o") == 0 || strcmp(args[1], "+o") == 0)) {
+            stats_mode = (args[1][0] == '-');
+        } else {
+            printf("set: usage: set -o|+o pipefail | set -o|+o stats\n");
+        }
+        return 1;
+    } else if (strcmp(args[0], "stats") == 0) {
+        // stats [-j] [N] | stats -c
+        int a = 1;
+        bool json = args[a] != NULL && strcmp(args[a], "-j") == 0;
+        if (json) a++;
+        if (args[a] != NULL && strcmp(args[a], "-c") == 0) {
+            for (int i = 0; i < STATS_SIZE; i++) {
+                free(stats_log[i].command);
+                stats_log[i].command = NULL;
+            }
+            stats_total = 0;
+        } else {
+            show_stats(args[a] != NULL ? atoi(args[a]) : 0, json);
+        }
+        return 1;
+    } else if (strcmp(args[0], "hash") == 0) {
+        if (args[1] == NULL) {
+            show_hash();
+        } else if (strcmp(args[1], "-r") == 0) {
+            clear_hash();
+        } else {
+            // hash name...: look the commands up now
+            for (int i = 1; args[i] != NULL; i++) {
+                bool hashed;
+                if (strchr(args[i], '/') == NULL && find_command(args[i], &hashed) == NULL) {
+                    printf("hash: %s: not found\n", args[i]);
+                }
+            }
+        }
+        return 1;
+    } else if (strcmp(args[0], "jobs") == 0) {
+        list_jobs();
+        return 1;
+    } else if (strcmp(args[0], "fg") == 0 || strcmp(args[0], "bg") == 0) {
+        job_t *job = find_job(args[0], args[1]);
+        builtin_status = job == NULL ? 1 : continue_job(job, args[0][0] == 'f');
+        return 1;
+    } else if (strcmp(args[0], "wait") == 0) {
+        builtin_status = wait_jobs(args[1]);
+        return 1;
+    } else if (strcmp(args[0], "parallel") == 0) {
+        builtin_status = parallel_builtin(args);
         return 1;
     }
     return 0;
 }
 
-// Redirection code
-int handle_redirections(char *args[]) {
-    int fd_in = -1, fd_out = -1;
-    int append = 0;
+// Names builtin_command() handles
+bool is_builtin(const char *name) {
+    static const char *names[] = { "bg", "cd", "clear", "exit", "fg", "hash", "history", "jobs", "parallel", "set", "stats", "wait" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "<") == 0 && args[i+1] != NULL) {
-            if ((fd_in = open(args[i+1], O_RDONLY)) < 0) {
-                perror("input redirection failed");
-                return -1;
+// Exit code of a child the way a shell reports it, 128 + signal if it was killed
+int exit_code(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+// Wall time since start on the monotonic clock, safe in signal handlers
+double seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void block_sigchld(sigset_t *old) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+void restore_sigmask(sigset_t *old) {
+    sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+// Reaps the processes of background jobs as they exit, stop or continue.
+// Foreground jobs are left to wait_for_job.
+void handle_sigchld(int sig) {
+    (void)sig;
+    int saved = errno;
+    for (int j = 0; j < MAX_JOBS; j++) {
+        job_t *job = &jobs[j];
+        if (job->id == 0 || !job->background) {
+            continue;
+        }
+        for (int i = 0; i < job->count; i++) {
+            int status;
+            while (job->codes[i] == -1 &&
+                   wait4(job->pids[i], &status, WNOHANG | WUNTRACED | WCONTINUED,
+                         job->usage ? &job->usage[i] : NULL) == job->pids[i]) {
+                if (WIFSTOPPED(status)) {
+                    job->stopped = true;
+                } else if (WIFCONTINUED(status)) {
+                    job->stopped = false;
+                } else {
+                    job->codes[i] = exit_code(status);
+                    job->live--;
+                    if (job->seconds) job->seconds[i] = seconds_since(&job->started);
+                }
             }
-            dup2(fd_in, STDIN_FILENO);
-            close(fd_in);
-            args[i] = args[i+1] = NULL;
         }
-        else if (strcmp(args[i], ">") == 0 && args[i+1] != NULL) {
-            if ((fd_out = open(args[i+1], O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
-                perror("output redirection failed");
-                return -1;
+    }
+    errno = saved;
+}
+
+// An interactive shell waits until it is in the foreground, then takes its
+// own process group and the terminal. It ignores the stop signals so only
+// its jobs are stopped.
+void start_job_control(void) {
+    while (tcgetpgrp(STDIN_FILENO) != getpgrp()) {
+        kill(-getpgrp(), SIGTTIN);
+    }
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    setpgid(0, 0); // fails harmlessly if the shell leads its session
+    shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    job_control = true;
+}
+
+job_t *new_job(int count, char *command) {
+    job_t *job = NULL;
+    int id = 1;
+    for (int j = 0; j < MAX_JOBS; j++) {
+        if (jobs[j].id == 0 && job == NULL) job = &jobs[j];
+        if (jobs[j].id >= id) id = jobs[j].id + 1;
+    }
+    if (job == NULL) {
+        fprintf(stderr, "siu: too many jobs\n");
+        free(command);
+        return NULL;
+    }
+    pid_t *pids = malloc(count * sizeof(pid_t));
+    int *codes = malloc(count * sizeof(int));
+    if (pids == NULL || codes == NULL) {
+        fprintf(stderr, "siu: out of memory starting a job\n");
+        free(pids);
+        free(codes);
+        free(command);
+        return NULL;
+    }
+    job->pids = pids;
+    job->codes = codes;
+    job->count = count;
+    job->live = 0;
+    job->pgid = 0;
+    job->stopped = false;
+    job->background = false;
+    job->command = command;
+    job->timed = false;
+    job->stages = NULL;
+    job->usage = NULL;
+    job->seconds = NULL;
+    job->id = id;
+    return job;
+}
+
+// Makes a job collect the resource use of each of its processes, for time
+// and the stats log. Called before any of them starts.
+void measure_job(job_t *job, bool timed, pipeline_node *pipeline) {
+    job->timed = timed;
+    job->stages = calloc(job->count, sizeof(char *));
+    job->usage = calloc(job->count, sizeof(struct rusage));
+    job->seconds = calloc(job->count, sizeof(double));
+    for (int i = 0; i < job->count; i++) {
+        if (pipeline == NULL) {
+            job->stages[i] = strdup(job->command);
+            continue;
+        }
+        size_t size;
+        FILE *out = open_memstream(&job->stages[i], &size);
+        describe_command(out, &pipeline->stages[i]);
+        fclose(out);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+}
+
+// Prints what time shows for a command, on stderr like the shell's errors
+void print_time(const char *command, double real, struct rusage *usage) {
+    fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs  rss %ld KiB  cs %ld/%ld  %s\n", real,
+            usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+            usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6,
+            usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw, command);
+}
+
+// Forgets a finished or abandoned job. A measured job's processes go to the
+// stats log first, and a timed one's are printed.
+void free_job(job_t *job) {
+    if (job->usage != NULL && job->live == 0) {
+        fflush(stdout);
+        for (int i = 0; i < job->count; i++) {
+            if (job->timed) print_time(job->stages[i], job->seconds[i], &job->usage[i]);
+            if (job->timed || stats_mode) {
+                record_stats(job->stages[i], job->codes[i], job->seconds[i], &job->usage[i]);
             }
-            dup2(fd_out, STDOUT_FILENO);
-            close(fd_out);
-            args[i] = args[i+1] = NULL;
         }
-        else if (strcmp(args[i], ">>") == 0 && args[i+1] != NULL) {
-            if ((fd_out = open(args[i+1], O_WRONLY|O_CREAT|O_APPEND, 0644)) < 0) {
-                perror("append redirection failed");
-                return -1;
+    }
+    for (int i = 0; job->stages != NULL && i < job->count; i++) {
+        free(job->stages[i]);
+    }
+    free(job->stages);
+    free(job->usage);
+    free(job->seconds);
+    free(job->pids);
+    free(job->codes);
+    free(job->command);
+    memset(job, 0, sizeof(job_t));
+}
+
+// Exit code of a finished job: its last command's, or with pipefail the
+// last failing one's
+int job_status(job_t *job) {
+    int result = job->codes[job->count - 1];
+    int failed = 0;
+    for (int i = 0; i < job->count; i++) {
+        if (job->codes[i] != 0) failed = job->codes[i];
+    }
+    if (pipefail && failed != 0) {
+        result = failed;
+    }
+    return result;
+}
+
+// Finds the job a builtin names, the newest one if spec is NULL
+job_t *find_job(const char *builtin, const char *spec) {
+    job_t *found = NULL;
+    if (spec == NULL) {
+        for (int j = 0; j < MAX_JOBS; j++) {
+            if (jobs[j].id != 0 && (found == NULL || jobs[j].id > found->id)) found = &jobs[j];
+        }
+        if (found == NULL) printf("%s: no current job\n", builtin);
+        return found;
+    }
+
+    // %N or N is a job number, a bigger number can be a process id
+    long n = atol(spec[0] == '%' ? spec + 1 : spec);
+    for (int j = 0; j < MAX_JOBS && found == NULL; j++) {
+        if (jobs[j].id == 0) continue;
+        if (jobs[j].id == n) found = &jobs[j];
+        for (int i = 0; i < jobs[j].count && spec[0] != '%' && n > MAX_JOBS; i++) {
+            if (jobs[j].pids[i] == n) found = &jobs[j];
+        }
+    }
+    if (found == NULL) printf("%s: %s: no such job\n", builtin, spec);
+    return found;
+}
+
+// Waits for a foreground job to exit or stop, with the terminal handed to
+// it while it runs. Returns its exit code, or 128 + SIGTSTP if it stopped.
+int wait_for_job(job_t *job) {
+    if (job_control) tcsetpgrp(STDIN_FILENO, job->pgid);
+    bool stopped = false;
+    for (int i = 0; i < job->count && !stopped; i++) {
+        while (job->codes[i] == -1) {
+            int status;
+            if (wait4(job->pids[i], &status, job_control ? WUNTRACED : 0,
+                      job->usage ? &job->usage[i] : NULL) == -1) {
+                if (errno == EINTR) continue;
+                job->codes[i] = 1;
+                job->live--;
+            } else if (WIFSTOPPED(status)) {
+                stopped = true;
+                break;
+            } else {
+                job->codes[i] = exit_code(status);
+                job->live--;
+                if (job->seconds) job->seconds[i] = seconds_since(&job->started);
             }
-            dup2(fd_out, STDOUT_FILENO);
-            close(fd_out);
-            args[i] = args[i+1] = NULL;
         }
     }
+    if (job_control) tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+    if (stopped) {
+        sigset_t old;
+        block_sigchld(&old);
+        job->stopped = true;
+        job->background = true;
+        restore_sigmask(&old);
+        printf("\n[%d]+  %-24s%s\n", job->id, "Stopped", job->command);
+        return 128 + SIGTSTP;
+    }
+    int status = job_status(job);
+    if (job_control && status == 128 + SIGINT) {
+        printf("\n"); // the prompt goes below the ^C
+    }
+    free_job(job);
+    return status;
+}
+
+// fg and bg: continue a job in the foreground and wait for it, or let a
+// stopped job run on in the background
+int continue_job(job_t *job, bool foreground) {
+    if (!job_control) {
+        printf("%s: no job control\n", foreground ? "fg" : "bg");
+        return 1;
+    }
+    if (!foreground && !job->stopped) {
+        printf("bg: job %d already in background\n", job->id);
+        return 0;
+    }
+
+    sigset_t old;
+    block_sigchld(&old);
+    job->stopped = false;
+    job->background = !foreground;
+    restore_sigmask(&old);
+
+    if (foreground) {
+        printf("%s\n", job->command);
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+        kill(-job->pgid, SIGCONT);
+        return wait_for_job(job);
+    }
+    printf("[%d]+ %s &\n", job->id, job->command);
+    kill(-job->pgid, SIGCONT);
     return 0;
 }
 
+// wait [%N | pid]: waits until one job or every background job is done or
+// stopped. Ctrl+C stops the waiting.
+int wait_jobs(const char *spec) {
+    job_t *only = NULL;
+    if (spec != NULL && (only = find_job("wait", spec)) == NULL) {
+        return 127;
+    }
 
-// External command execution
-void external_command(char *args[]) {
-    pid_t pid = fork();
-    
-    if (pid == 0) {
-        signal(SIGINT, SIG_DFL);
-        execvp(args[0], args);
-        perror("execvp failed");
-        exit(1);
-    } 
-    else if (pid > 0) {
-        wait(NULL);
-    } 
-    else {
-        perror("fork failed");
+    sigset_t old;
+    block_sigchld(&old);
+    interrupted = 0;
+    while (!interrupted) {
+        bool pending = false;
+        for (int j = 0; j < MAX_JOBS; j++) {
+            job_t *job = &jobs[j];
+            if (job->id != 0 && (only == NULL || job == only) && job->live > 0 && !job->stopped) {
+                pending = true;
+            }
+        }
+        if (!pending) break;
+        sigsuspend(&old);
+    }
+
+    int status = 0;
+    if (interrupted) {
+        status = 130;
+    } else if (only != NULL && only->live == 0) {
+        status = job_status(only);
+        free_job(only);
+    } else if (only != NULL) {
+        status = 128 + SIGTSTP;
     }
+    restore_sigmask(&old);
+    return status;
 }
 
+// State of a job the way jobs and the Done messages show it
+void job_state(job_t *job, char *state, size_t size) {
+    if (job->live > 0) {
+        snprintf(state, size, "%s", job->stopped ? "Stopped" : "Running");
+    } else if (job_status(job) == 0) {
+        snprintf(state, size, "Done");
+    } else {
+        snprintf(state, size, "Exit %d", job_status(job));
+    }
+}
+
+// jobs builtin, finished jobs are shown once and then forgotten
+void list_jobs(void) {
+    sigset_t old;
+    block_sigchld(&old);
+    int newest = 0;
+    for (int j = 0; j < MAX_JOBS; j++) {
+        if (jobs[j].id > newest) newest = jobs[j].id;
+    }
+    for (int id = 1; id <= newest; id++) {
+        for (int j = 0; j < MAX_JOBS; j++) {
+            job_t *job = &jobs[j];
+            if (job->id != id) continue;
+            char state[32];
+            job_state(job, state, sizeof(state));
+            printf("[%d]%c  %-24s%s%s\n", job->id, id == newest ? '+' : ' ', state, job->command,
+                   job->live > 0 && !job->stopped ? " &" : "");
+            if (job->live == 0) free_job(job);
+        }
+    }
+    restore_sigmask(&old);
+}
+
+// Before each prompt: tells about background jobs that finished and forgets
+// them. Without job control they are forgotten quietly.
+void report_jobs(void) {
+    sigset_t old;
+    block_sigchld(&old);
+    for (int j = 0; j < MAX_JOBS; j++) {
+        job_t *job = &jobs[j];
+        if (job->id == 0 || !job->background || job->live > 0) {
+            continue;
+        }
+        if (job_control) {
+            char state[32];
+            job_state(job, state, sizeof(state));
+            printf("[%d]+  %-24s%s\n", job->id, state, job->command);
+        }
+        free_job(job);
+    }
+    restore_sigmask(&old);
+}
+
+// Adds a finished command to the stats ring, over the oldest one when full
+void record_stats(const char *command, int code, double real, struct rusage *usage) {
+    stats_entry *entry = &stats_log[stats_total % STATS_SIZE];
+    free(entry->command);
+    entry->command = strdup(command);
+    entry->when = time(NULL);
+    entry->code = code;
+    entry->real = real;
+    entry->user = usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+    entry->sys = usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+    entry->max_rss = usage->ru_maxrss;
+    entry->voluntary = usage->ru_nvcsw;
+    entry->involuntary = usage->ru_nivcsw;
+    stats_total++;
+}
 
-// Removing leading and trailing spaces in commands
-void remove_space(char *str) {
-    int st = 0;
-    while (str[st] == ' ') {
-        st++;
+// stats builtin: the last count logged commands, all kept ones if count is
+// 0, as a table or as a JSON array
+void show_stats(int count, bool json) {
+    long kept = stats_total < STATS_SIZE ? stats_total : STATS_SIZE;
+    long first = stats_total - kept;
+    if (count > 0 && count < kept) {
+        first = stats_total - count;
     }
-    if (st > 0) {
-        int i = 0;
-        while (str[st]) str[i++] = str[st++];
-        str[i] = '\0';
+    if (json) printf("[");
+    for (long n = first; n < stats_total; n++) {
+        stats_entry *entry = &stats_log[n % STATS_SIZE];
+        if (!json) {
+            char when[16];
+            strftime(when, sizeof(when), "%H:%M:%S", localtime(&entry->when));
+            printf("%5ld  %s  %8.3fs real %8.3fs user %8.3fs sys %8ld KiB %6ld/%-4ld cs  exit %-3d %s\n",
+                   n + 1, when, entry->real, entry->user, entry->sys, entry->max_rss,
+                   entry->voluntary, entry->involuntary, entry->code, entry->command);
+            continue;
+        }
+        printf("%s\n  {\"n\": %ld, \"time\": %ld, \"command\": \"", n > first ? "," : "", n + 1,
+               (long)entry->when);
+        for (const unsigned char *c = (const unsigned char *)entry->command; *c; c++) {
+            if (*c == '"' || *c == '\\') printf("\\%c", *c);
+            else if (*c < 0x20) printf("\\u%04x", *c);
+            else putchar(*c);
+        }
+        printf("\", \"exit\": %d, \"real\": %.6f, \"user\": %.6f, \"sys\": %.6f, "
+               "\"max_rss_kib\": %ld, \"voluntary_cs\": %ld, \"involuntary_cs\": %ld}",
+               entry->code, entry->real, entry->user, entry->sys, entry->max_rss,
+               entry->voluntary, entry->involuntary);
     }
-    int end = strlen(str) - 1;
-    while (end >= 0 && str[end] == ' ') str[end--] = '\0';
+    if (json) printf("%s]\n", stats_total > first ? "\n" : "");
 }
 
+int pidfd_open_compat(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
 
-// Piping code 
-int piping(char *inp) {
+// One command parallel has in flight. Its stdout and stderr go to memory
+// files that are copied out in one piece when it exits.
+typedef struct {
     pid_t pid;
-    int pipefd[2];
-    int counter = 0;
-    char *commands[MAX_ARGS];
-    int prev_pipe_read = -1;
-    int status = 0;
+    int pidfd;       // -1 when pidfds are not available
+    int out_fd;
+    int err_fd;
+    char **argv;
+    const char *input;
+    struct timespec start;
+} parallel_slot;
 
-    // Split commands by pipe
-    commands[counter] = strtok(inp, "|");
-    while (commands[counter] != NULL && counter < MAX_ARGS - 1) {
-        counter++;
-        commands[counter] = strtok(NULL, "|");
+// Copies a memory file with a finished command's output to fd
+void flush_output(int from, int to) {
+    char buf[65536];
+    ssize_t got;
+    lseek(from, 0, SEEK_SET);
+    while ((got = read(from, buf, sizeof(buf))) > 0) {
+        for (ssize_t done = 0; done < got; ) {
+            ssize_t put = write(to, buf + done, got - done);
+            if (put <= 0) return;
+            done += put;
+        }
     }
+}
 
-    for (int i = 0; i < counter; i++) {
-        // Create pipe for all commands except last
-        if (i < counter - 1) {
-            if (pipe(pipefd) == -1) {
-                perror("pipe failed");
-                return -1;
+// Builds the command for one input: every {} is replaced by it, or it is
+// added as the last argument if there is no {}
+char **parallel_argv(char **cmd, int cmd_len, const char *input) {
+    char **argv = malloc((cmd_len + 2) * sizeof(char *));
+    bool placed = false;
+    for (int i = 0; i < cmd_len; i++) {
+        const char *hole = strstr(cmd[i], "{}");
+        if (hole == NULL) {
+            argv[i] = strdup(cmd[i]);
+            continue;
+        }
+        placed = true;
+        char *text = NULL;
+        size_t size;
+        FILE *out = open_memstream(&text, &size);
+        for (const char *p = cmd[i]; hole != NULL; hole = strstr(p, "{}")) {
+            fprintf(out, "%.*s%s", (int)(hole - p), p, input);
+            p = hole + 2;
+            if (strstr(p, "{}") == NULL) fputs(p, out);
+        }
+        fclose(out);
+        argv[i] = text;
+    }
+    argv[cmd_len] = placed ? NULL : strdup(input);
+    argv[cmd_len + 1] = NULL;
+    return argv;
+}
+
+// Reaps a finished command, prints its output and frees its slot. Returns
+// its exit code.
+int parallel_reap(parallel_slot *slot) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    int rc = slot->pidfd != -1 ? waitid((idtype_t)P_PIDFD, slot->pidfd, &info, WEXITED)
+                               : waitid(P_PID, slot->pid, &info, WEXITED);
+    int code = 1;
+    if (rc == 0) {
+        code = info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+    }
+    if (slot->pidfd != -1) close(slot->pidfd);
+
+    fflush(stdout);
+    if (slot->out_fd != -1) {
+        flush_output(slot->out_fd, STDOUT_FILENO);
+        close(slot->out_fd);
+    }
+    if (slot->err_fd != -1) {
+        flush_output(slot->err_fd, STDERR_FILENO);
+        close(slot->err_fd);
+    }
+    for (char **a = slot->argv; *a != NULL; a++) free(*a);
+    free(slot->argv);
+    slot->pid = 0;
+    return code;
+}
+
+// parallel [-j N] cmd [args...] ::: inputs...
+// Runs cmd once per input with at most N (default: the number of CPUs) in
+// flight. Without ::: the inputs are the lines of stdin. Each command's
+// output is printed in one piece when it exits, followed at the end by a
+// summary of failures and timing on stderr. The exit code is the number of
+// failed commands, at most 101.
+int parallel_builtin(char *args[]) {
+    long width = sysconf(_SC_NPROCESSORS_ONLN);
+    int a = 1;
+    if (args[a] != NULL && strncmp(args[a], "-j", 2) == 0) {
+        const char *n = args[a][2] != '\0' ? args[a] + 2 : args[++a];
+        width = n != NULL ? atol(n) : 0;
+        a++;
+    }
+    int cmd_start = a;
+    while (args[a] != NULL && strcmp(args[a], ":::") != 0) a++;
+    int cmd_len = a - cmd_start;
+    if (cmd_len == 0 || width < 1) {
+        fprintf(stderr, "parallel: usage: parallel [-j N] command [args...] [::: inputs...]\n");
+        return 2;
+    }
+
+    // Inputs after :::, or one per line of stdin
+    char **inputs;
+    int count = 0;
+    char **lines = NULL;
+    if (args[a] != NULL) {
+        inputs = &args[a + 1];
+        while (inputs[count] != NULL) count++;
+    } else {
+        int cap = 0;
+        char *line = NULL;
+        size_t line_cap = 0;
+        ssize_t len;
+        while ((len = getline(&line, &line_cap, stdin)) != -1) {
+            if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                lines = realloc(lines, cap * sizeof(char *));
             }
+            lines[count++] = strdup(line);
         }
+        free(line);
+        inputs = lines;
+    }
+
+    if (width > count) width = count > 0 ? count : 1;
+    parallel_slot *slots = calloc(width, sizeof(parallel_slot));
+    struct pollfd *fds = malloc(width * sizeof(struct pollfd));
+    int *fd_slot = malloc(width * sizeof(int));
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double busy = 0;
+    int next = 0, running = 0, failed = 0;
+    interrupted = 0;
 
-        pid = fork();
-        if (pid == 0) { // Child process
-            // Handle input from previous command
-            if (prev_pipe_read != -1) {
-                dup2(prev_pipe_read, STDIN_FILENO);
-                close(prev_pipe_read);
+    while (next < count || running > 0) {
+        // Fill every free slot
+        for (int s = 0; s < width && next < count && !interrupted; s++) {
+            parallel_slot *slot = &slots[s];
+            if (slot->pid != 0) continue;
+            slot->input = inputs[next++];
+            slot->argv = parallel_argv(&args[cmd_start], cmd_len, slot->input);
+            slot->out_fd = memfd_create("parallel-out", MFD_CLOEXEC);
+            slot->err_fd = memfd_create("parallel-err", MFD_CLOEXEC);
+            clock_gettime(CLOCK_MONOTONIC, &slot->start);
+            pid_t pid = spawn_command(slot->argv, -1, slot->out_fd, slot->err_fd, -1, false);
+            if (pid < 0) {
+                if (failed++ < 10) fprintf(stderr, "parallel: failed to start: %s\n", slot->input);
+                for (char **arg = slot->argv; *arg != NULL; arg++) free(*arg);
+                free(slot->argv);
+                if (slot->out_fd != -1) close(slot->out_fd);
+                if (slot->err_fd != -1) close(slot->err_fd);
+                slot->pid = 0;
+                continue;
             }
+            slot->pid = pid;
+            slot->pidfd = pidfd_open_compat(pid);
+            running++;
+        }
+        if (running == 0) {
+            if (next >= count || interrupted) break;
+            continue; // every command so far failed to start
+        }
 
-            // Handle output to next command
-            if (i < counter - 1) {
-                close(pipefd[0]); // Close read end
-                dup2(pipefd[1], STDOUT_FILENO);
-                close(pipefd[1]);
+        // Wait for any command to exit, or for the oldest without pidfds
+        int nfds = 0;
+        bool all_pidfds = true;
+        for (int s = 0; s < width; s++) {
+            if (slots[s].pid <= 0) continue;
+            if (slots[s].pidfd == -1) all_pidfds = false;
+            fds[nfds].fd = slots[s].pidfd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            fd_slot[nfds++] = s;
+        }
+        if (all_pidfds && poll(fds, nfds, -1) == -1) {
+            continue; // EINTR, e.g. Ctrl+C, which stops new launches
+        }
+        for (int f = 0; f < nfds; f++) {
+            if (all_pidfds && !(fds[f].revents & (POLLIN | POLLHUP))) continue;
+            parallel_slot *slot = &slots[fd_slot[f]];
+            const char *input = slot->input;
+            busy += seconds_since(&slot->start);
+            int code = parallel_reap(slot);
+            running--;
+            if (code != 0 && failed++ < 10) {
+                fprintf(stderr, "parallel: exit %d: %s\n", code, input);
             }
+            if (!all_pidfds) break;
+        }
+    }
 
-            // Process current command with redirection support
-            remove_space(commands[i]);
-            
-            char *args[MAX_ARGS];
-            int input_redir = 0;
-            int output_redir = 0;
-            char *input_file = NULL;
-            char *output_file = NULL;
-            
-            parse_input(commands[i], args, &input_redir, &input_file, 
-                       &output_redir, &output_file);
+    double elapsed = seconds_since(&start);
+    fprintf(stderr, "parallel: %d of %d commands run, %d failed, %.2fs elapsed, %.2fs of command time, %ld at a time%s\n",
+            next, count, failed, elapsed, busy, width, interrupted ? ", interrupted" : "");
+    if (failed > 10) {
+        fprintf(stderr, "parallel: only the first 10 failures are listed\n");
+    }
 
-            // Handle input redirection (overrides pipe input)
-            if (input_redir) {
-                int fd = open(input_file, O_RDONLY);
-                if (fd < 0) {
-                    perror("open input file");
-                    exit(1);
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
-            }
-
-            // Handle output redirection (overrides pipe output)
-            if (output_redir) {
-                int flags = O_WRONLY | O_CREAT;
-                if (output_redir == 1) flags |= O_TRUNC;  // >
-                else flags |= O_APPEND;                   // >>
-                
-                int fd = open(output_file, flags, 0644);
-                if (fd < 0) {
-                    perror("open output file");
-                    exit(1);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
+    for (int i = 0; lines != NULL && i < count; i++) free(lines[i]);
+    free(lines);
+    free(slots);
+    free(fds);
+    free(fd_slot);
+    return failed > 101 ? 101 : failed;
+}
+
+// Writes a command back as text for jobs and stats
+void describe_command(FILE *out, command_node *cmd) {
+    for (int a = 0; cmd->args[a] != NULL; a++) {
+        fprintf(out, a > 0 ? " %s" : "%s", cmd->args[a]);
+    }
+    if (cmd->input_file) fprintf(out, " < %s", cmd->input_file);
+    if (cmd->output_file) fprintf(out, cmd->output_redir == 2 ? " >> %s" : " > %s", cmd->output_file);
+    if (cmd->error_file) fprintf(out, cmd->error_redir == 2 ? " 2>> %s" : " 2> %s", cmd->error_file);
+}
+
+void describe_pipeline(FILE *out, pipeline_node *pipeline) {
+    for (int i = 0; i < pipeline->count; i++) {
+        if (i > 0) fprintf(out, " | ");
+        describe_command(out, &pipeline->stages[i]);
+    }
+}
+
+// Text of the pipelines from..to-1 of a list joined by && and ||
+char *describe_list(list_node *list, int from, int to) {
+    char *text = NULL;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+    for (int i = from; i < to; i++) {
+        if (i > from) fprintf(out, list->items[i].connector == CONNECT_AND ? " && " : " || ");
+        describe_pipeline(out, &list->items[i]);
+    }
+    fclose(out);
+    return text;
+}
+
+// Runs a parsed pipeline as a job. Every stage is started before any is
+// waited for, so the stages run concurrently and a stage never blocks on a
+// full pipe nobody reads. The result is the exit code of the last stage, or
+// with pipefail the exit code of the last stage that failed. A single
+// builtin runs in the shell itself. A background job is only started, with
+// job control its number and process group are printed.
+int run_pipeline(pipeline_node *pipeline, bool background) {
+    int counter = pipeline->count;
+    bool measured = pipeline->timed || stats_mode;
+    if (counter == 1 && !background && !measured && builtin_command(pipeline->stages[0].args)) {
+        return builtin_status;
+    }
+    if (counter == 1 && !background && measured) {
+        // A builtin's cost is what the shell and the children it waited
+        // for used meanwhile
+        struct rusage self, children;
+        struct timespec start;
+        getrusage(RUSAGE_SELF, &self);
+        getrusage(RUSAGE_CHILDREN, &children);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (builtin_command(pipeline->stages[0].args)) {
+            double real = seconds_since(&start);
+            struct rusage self_after, children_after, usage;
+            getrusage(RUSAGE_SELF, &self_after);
+            getrusage(RUSAGE_CHILDREN, &children_after);
+            memset(&usage, 0, sizeof(usage));
+            timersub(&self_after.ru_utime, &self.ru_utime, &usage.ru_utime);
+            timeradd(&usage.ru_utime, &children_after.ru_utime, &usage.ru_utime);
+            timersub(&usage.ru_utime, &children.ru_utime, &usage.ru_utime);
+            timersub(&self_after.ru_stime, &self.ru_stime, &usage.ru_stime);
+            timeradd(&usage.ru_stime, &children_after.ru_stime, &usage.ru_stime);
+            timersub(&usage.ru_stime, &children.ru_stime, &usage.ru_stime);
+            usage.ru_maxrss = self_after.ru_maxrss;
+            usage.ru_nvcsw = self_after.ru_nvcsw - self.ru_nvcsw;
+            usage.ru_nivcsw = self_after.ru_nivcsw - self.ru_nivcsw;
+
+            char *text = NULL;
+            size_t size;
+            FILE *out = open_memstream(&text, &size);
+            describe_command(out, &pipeline->stages[0]);
+            fclose(out);
+            if (pipeline->timed) print_time(text, real, &usage);
+            record_stats(text, builtin_status, real, &usage);
+            free(text);
+            return builtin_status;
+        }
+    }
+
+    list_node one = { pipeline, 1, NULL };
+    job_t *job = new_job(counter, describe_list(&one, 0, 1));
+    if (job == NULL) {
+        return 1;
+    }
+
+    // A background job is reaped by the SIGCHLD handler from the start
+    sigset_t old;
+    block_sigchld(&old);
+    job->background = background;
+    if (measured) measure_job(job, pipeline->timed, pipeline);
+
+    int pipefd[2];
+    int prev_pipe_read = -1;
+    for (int i = 0; i < counter; i++) {
+        job->pids[i] = -1;
+        job->codes[i] = 127;
+
+        // Create pipe for all commands except last, close-on-exec so each
+        // stage only keeps the ends it is given
+        if (i < counter - 1) {
+            if (pipe2(pipefd, O_CLOEXEC) == -1) {
+                perror("pipe failed");
+                job->codes[i] = 1;
+                job->count = i + 1;
+                break;
             }
+        }
 
-            // Execute command
-            signal(SIGINT, SIG_DFL);
-            execvp(args[0], args);
-            perror("execvp failed");
-            exit(1);
-        } 
-        else if (pid < 0) {
-            perror("fork failed");
-            return -1;
+        command_node *cmd = &pipeline->stages[i];
+        char **args = cmd->args;
+
+        // Redirections override the pipe ends
+        int in_fd, out_fd, err_fd;
+        pid_t pid = -1;
+        pid_t pgid = job_control ? job->pgid : -1;
+        bool take_terminal = job_control && !background && job->pgid == 0;
+        if (open_redirections(cmd, &in_fd, &out_fd, &err_fd) != 0) {
+            job->codes[i] = 1;
+        } else {
+            int stage_in = in_fd != -1 ? in_fd : prev_pipe_read;
+            int stage_out = out_fd != -1 ? out_fd : (i < counter - 1 ? pipefd[1] : -1);
+            if (args[0] == NULL) {
+                job->codes[i] = 0; // Only redirections: > file creates or truncates it
+            } else if (is_builtin(args[0])) {
+                pid = fork_builtin(args, stage_in, stage_out, err_fd, pgid, take_terminal);
+            } else {
+                pid = spawn_command(args, stage_in, stage_out, err_fd, pgid, take_terminal);
+            }
+            if (in_fd != -1) close(in_fd);
+            if (out_fd != -1) close(out_fd);
+            if (err_fd != -1) close(err_fd);
+        }
+        if (pid > 0) {
+            if (job_control) {
+                if (job->pgid == 0) job->pgid = pid;
+                setpgid(pid, job->pgid); // the child may not have done it yet
+            }
+            job->pids[i] = pid;
+            job->codes[i] = -1;
+            job->live++;
         }
 
         // Parent process cleanup
         if (prev_pipe_read != -1) close(prev_pipe_read);
+        prev_pipe_read = -1;
         if (i < counter - 1) {
             close(pipefd[1]); // Close write end
             prev_pipe_read = pipefd[0]; // Save read end for next command
         }
+    }
 
-        // Wait for current command to finish
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-            if (prev_pipe_read != -1) close(prev_pipe_read);
-            return -1;
+    // Final cleanup, a stage left without a reader gets EOF or SIGPIPE
+    if (prev_pipe_read != -1) close(prev_pipe_read);
+    restore_sigmask(&old);
+
+    if (background) {
+        if (job_control) printf("[%d] %d\n", job->id, job->pgid);
+        return 0;
+    }
+    return wait_for_job(job);
+}
+
+// Runs the pipelines from..to-1 of a list. A && pipeline runs only if the
+// status so far is 0 and a || pipeline only if it is not, a skipped one
+// leaves the status as it was.
+int run_and_or(list_node *list, int from, int to) {
+    for (int i = from; i < to; i++) {
+        pipeline_node *pipeline = &list->items[i];
+        if ((pipeline->connector == CONNECT_AND && last_status != 0) ||
+            (pipeline->connector == CONNECT_OR && last_status == 0)) {
+            continue;
         }
+        last_status = run_pipeline(pipeline, false);
     }
+    return last_status;
+}
 
-    // Final cleanup
-    if (prev_pipe_read != -1) close(prev_pipe_read);
-    return 0;
+// An && / || list ended by & runs in a forked copy of the shell
+void run_background_list(list_node *list, int from, int to) {
+    job_t *job = new_job(1, describe_list(list, from, to));
+    if (job == NULL) {
+        return;
+    }
+    sigset_t old;
+    block_sigchld(&old);
+    job->background = true;
+    if (stats_mode) measure_job(job, false, NULL);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (job_control) setpgid(0, 0);
+        job_control = false;
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        for (int j = 0; j < MAX_JOBS; j++) {
+            jobs[j].id = 0; // the parent's jobs are not this copy's
+        }
+        restore_sigmask(&old);
+        _exit(run_and_or(list, from, to));
+    }
+    if (pid < 0) {
+        perror("fork failed");
+        job->pids[0] = -1;
+        job->codes[0] = 1;
+    } else {
+        if (job_control) setpgid(pid, pid);
+        job->pgid = pid;
+        job->pids[0] = pid;
+        job->codes[0] = -1;
+        job->live = 1;
+    }
+    restore_sigmask(&old);
+    if (job_control && pid > 0) printf("[%d] %d\n", job->id, pid);
 }
 
+// Runs the pipelines of a line in order, each && / || list as a unit. A
+// list ended by & is started in the background and its status is 0.
+int run_list(list_node *list) {
+    report_jobs();
+    int from = 0;
+    while (from < list->count) {
+        int to = from + 1;
+        while (to < list->count && list->items[to].connector != CONNECT_SEQ) {
+            to++;
+        }
+        if (!list->items[to - 1].background) {
+            run_and_or(list, from, to);
+        } else if (to - from == 1) {
+            last_status = run_pipeline(&list->items[from], true);
+        } else {
+            run_background_list(list, from, to);
+            last_status = 0;
+        }
+        from = to;
+    }
+    return last_status;
+}
 
-// Function to handle inputs, parsing and executing commands
+// Runs a script file or -c string. It is parsed completely first and
+// nothing runs if any line has a syntax error.
+int run_script(char *text) {
+    arena_t arena = { NULL };
+    bool ok;
+    list_node *script = parse_script(&arena, text, &ok);
+    if (!ok) {
+        arena_free(&arena);
+        return 2;
+    }
+    for (list_node *line = script; line != NULL; line = line->next) {
+        run_list(line);
+    }
+    arena_free(&arena);
+    return last_status;
+}
+
+// Reads all of a script file into one buffer that it is then parsed in
+char *read_script(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return NULL;
+    }
+    size_t size = 0, cap = 4096;
+    char *text = malloc(cap);
+    size_t got;
+    while (text != NULL && (got = fread(text + size, 1, cap - size - 1, in)) > 0) {
+        size += got;
+        if (cap - size - 1 == 0) {
+            cap *= 2;
+            char *bigger = realloc(text, cap);
+            if (bigger == NULL) free(text);
+            text = bigger;
+        }
+    }
+    fclose(in);
+    if (text != NULL) text[size] = '\0';
+    return text;
+}
+
+// Function to handle an interactive line, parsing and executing commands
 void take_input(char *inp) {
-    char *semi_comm;
-    char *saveptr1;
+    arena_t arena = { NULL };
+    list_node *list = parse_line(&arena, inp);
+    if (list == NULL) {
+        last_status = 2;
+    } else {
+        run_list(list);
+    }
+    arena_free(&arena);
+}
 
-    semi_comm = strtok_r(inp, ";", &saveptr1);
+// To handle history of shell command. The last HISTSIZE commands are kept
+// in a ring, their text in one growing buffer or in the mapped history file.
+typedef struct {
+    const char *text; // not NUL terminated
+    int len;
+    bool in_arena;    // text is in history_text rather than the mapped file
+} history_entry;
 
-    while (semi_comm != NULL) {
-        remove_space(semi_comm);
+history_entry *history;
+int history_size = 0;   // ring capacity, HISTSIZE
+int history_start = 0;  // ring index of the oldest entry
+int history_count = 0;
+long history_total = 0; // commands ever added, the number of the newest one
+char *history_text = NULL;
+size_t history_used = 0;
+size_t history_cap = 0;
+int history_fd = -1;    // history file, opened for appending
 
-        bool go_next = true;
-        char *and_comm;
-        char *saveptr2;
+history_entry *history_at(int i) { // 0 is the oldest entry
+    return &history[(history_start + i) % history_size];
+}
 
-        and_comm = strtok_r(semi_comm, "&&", &saveptr2);
+// N-gram index over the history for Ctrl-R, built the first time it is
+// used. Every 1, 2 and 3 byte sequence has the ascending numbers of the
+// commands containing it, numbers of commands that left the ring are
+// skipped when searching.
+typedef struct {
+    uint32_t key; // gram_key(), 0 marks a free slot
+    uint32_t len;
+    uint32_t cap;
+    uint32_t *ids;
+} posting_list;
 
-        while (and_comm != NULL) {
-            remove_space(and_comm);
+posting_list short_grams[256 + 65536]; // 1 and 2 byte grams, indexed directly
+posting_list *grams = NULL;            // 3 byte grams, open addressing
+size_t gram_slots = 0; // power of two
+size_t gram_used = 0;
+bool history_indexed = false;
 
-            if (go_next) {
-                if (strchr(and_comm, '|')) {
-                    int status = piping(and_comm);
-                    go_next = (status == 0);
-                } else {
-                    char *args[MAX_ARGS];
-                    int input_redir = 0;
-                    int output_redir = 0;
-                    char *input_file = NULL;
-                    char *output_file = NULL;
-                    
-                    parse_input(and_comm, args, &input_redir, &input_file, 
-                              &output_redir, &output_file);
-
-                    if (builtin_command(args)) {
-                        go_next = true;
-                    } else {
-                        pid_t pid = fork();
-                        if (pid == 0) {
-
-                            // Handle redirection in child
-                            if (input_redir && input_file) {
-                                int fd = open(input_file, O_RDONLY);
-                                if (fd < 0) {
-                                    perror("open input file");
-                                    exit(1);
-                                }
-                                dup2(fd, STDIN_FILENO);
-                                close(fd);
-                            }
-                            
-                            if (output_redir && output_file) {
-                                int fd;
-                                if (output_redir == 2) {
-                                    fd = open(output_file, O_WRONLY | O_CREAT | O_APPEND, 0644); // >>
-                                } else {
-                                    fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644); // >
-                                }
-                                
-                                
-                                if (fd < 0) {
-                                    perror("open output file");
-                                    exit(1);
-                                }
-                                dup2(fd, STDOUT_FILENO);
-                                close(fd);
-                            }
-                            
-                            signal(SIGINT, SIG_DFL);
-                            execvp(args[0], args);
-                            perror("Exec failed");
-                            exit(1);
-                        } else {
-                            int status;
-                            wait(&status);
-                            go_next = (WIFEXITED(status) && WEXITSTATUS(status) == 0);
-                        }
-                    }
+// The n bytes at p (n <= 3) packed with their length
+uint32_t gram_key(const char *p, int n) {
+    uint32_t key = (uint32_t)n << 24;
+    for (int i = 0; i < n; i++) {
+        key |= (uint32_t)(unsigned char)p[i] << (8 * (2 - i));
+    }
+    return key;
+}
+
+posting_list *gram_slot(posting_list *table, size_t slots, uint32_t key) {
+    size_t i = (key * 2654435761u) & (slots - 1);
+    while (table[i].key != 0 && table[i].key != key) {
+        i = (i + 1) & (slots - 1);
+    }
+    return &table[i];
+}
+
+// Finds a gram's list, adds an empty one if create is set
+posting_list *gram_list(uint32_t key, bool create) {
+    if ((key >> 24) < 3) {
+        posting_list *list = (key >> 24) == 1 ? &short_grams[(key >> 16) & 0xff]
+                                               : &short_grams[256 + ((key >> 8) & 0xffff)];
+        if (list->key == 0) {
+            if (!create) return NULL;
+            list->key = key;
+        }
+        return list;
+    }
+    if (create && (gram_used + 1) * 10 > gram_slots * 7) {
+        size_t slots = gram_slots ? gram_slots * 2 : 4096;
+        posting_list *table = calloc(slots, sizeof(posting_list));
+        if (table == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < gram_slots; i++) {
+            if (grams[i].key != 0) {
+                *gram_slot(table, slots, grams[i].key) = grams[i];
+            }
+        }
+        free(grams);
+        grams = table;
+        gram_slots = slots;
+    }
+    if (gram_slots == 0) {
+        return NULL;
+    }
+    posting_list *list = gram_slot(grams, gram_slots, key);
+    if (list->key == 0) {
+        if (!create) return NULL;
+        list->key = key;
+        gram_used++;
+    }
+    return list;
+}
+
+void index_history_entry(const char *text, int len, long number) {
+    for (int i = 0; i < len; i++) {
+        for (int n = 1; n <= 3 && i + n <= len; n++) {
+            posting_list *list = gram_list(gram_key(text + i, n), true);
+            if (list->len > 0 && list->ids[list->len - 1] == (uint32_t)number) {
+                continue; // gram seen earlier in this command
+            }
+            if (list->len == list->cap) {
+                list->cap = list->cap ? list->cap * 2 : 4;
+                list->ids = realloc(list->ids, list->cap * sizeof(uint32_t));
+                if (list->ids == NULL) {
+                    perror("realloc");
+                    exit(1);
                 }
             }
+            list->ids[list->len++] = number;
+        }
+    }
+}
+
+void build_history_index(void) {
+    long first = history_total - history_count + 1;
+    for (int i = 0; i < history_count; i++) {
+        index_history_entry(history_at(i)->text, history_at(i)->len, first + i);
+    }
+    history_indexed = true;
+}
+
+bool history_matches(long number, const char *query, int len) {
+    history_entry *e = history_at(number - (history_total - history_count + 1));
+    return memmem(e->text, e->len, query, len) != NULL;
+}
 
-            and_comm = strtok_r(NULL, "&&", &saveptr2);
+// Number of the newest command before 'before' that contains query, 0 if
+// none does. Only the commands in the shortest posting list of the query's
+// grams are looked at, for queries of up to three bytes those all match.
+long search_history(const char *query, int len, long before) {
+    long first = history_total - history_count + 1;
+    if (before > history_total + 1) before = history_total + 1;
+
+    if (len == 0 || !history_indexed) {
+        for (long n = before - 1; n >= first; n--) {
+            if (history_matches(n, query, len)) return n;
+        }
+        return 0;
+    }
+
+    int n = len < 3 ? len : 3;
+    posting_list *rarest = NULL;
+    for (int i = 0; i + n <= len; i++) {
+        posting_list *list = gram_list(gram_key(query + i, n), false);
+        if (list == NULL) {
+            return 0; // some gram occurs nowhere
         }
+        if (rarest == NULL || list->len < rarest->len) rarest = list;
+    }
 
-        semi_comm = strtok_r(NULL, ";", &saveptr1);
+    // Last id below 'before', then walk back to older commands
+    uint32_t lo = 0, hi = rarest->len;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (rarest->ids[mid] < before) lo = mid + 1;
+        else hi = mid;
+    }
+    for (long i = (long)lo - 1; i >= 0 && rarest->ids[i] >= first; i--) {
+        if (history_matches(rarest->ids[i], query, len)) return rarest->ids[i];
     }
+    return 0;
 }
 
-// To handle history of shell command
-char *history[HISTORY_SIZE];
-int history_count = 0;
+// Copies a command into history_text. When the buffer is full its live
+// strings are moved to a new buffer twice their size, so the text of
+// dropped entries is reclaimed and each command is copied O(1) times on average.
+const char *history_store(const char *command, int len) {
+    if (history_used + len > history_cap) {
+        size_t live = len;
+        for (int i = 0; i < history_count; i++) {
+            if (history_at(i)->in_arena) live += history_at(i)->len;
+        }
+        size_t cap = live * 2 > 4096 ? live * 2 : 4096;
+        char *text = malloc(cap);
+        if (text == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        size_t used = 0;
+        for (int i = 0; i < history_count; i++) {
+            history_entry *e = history_at(i);
+            if (e->in_arena) {
+                memcpy(text + used, e->text, e->len);
+                e->text = text + used;
+                used += e->len;
+            }
+        }
+        free(history_text);
+        history_text = text;
+        history_used = used;
+        history_cap = cap;
+    }
+    char *copy = history_text + history_used;
+    memcpy(copy, command, len);
+    history_used += len;
+    return copy;
+}
+
+// Puts an entry at the new end of the ring, overwriting the oldest when full
+void history_push(const char *text, int len, bool in_arena) {
+    int slot = (history_start + history_count) % history_size;
+    if (history_count == history_size) {
+        history_start = (history_start + 1) % history_size;
+    } else {
+        history_count++;
+    }
+    history[slot].text = text;
+    history[slot].len = len;
+    history[slot].in_arena = in_arena;
+    history_total++;
+}
 
 void add_to_history(const char *command) {
 
     if (strlen(command) == 0 || command[0] == '\n') { // Ignoring empty commands
         return; 
     }
-    if (history_count == HISTORY_SIZE) {
-        free(history[0]);
-        for (int i = 1; i < HISTORY_SIZE; i++) {
-            history[i - 1] = history[i];
+    int len = strlen(command);
+    const char *text = history_store(command, len);
+    history_push(text, len, true);
+    if (history_indexed) {
+        index_history_entry(text, len, history_total);
+    }
+
+    // One append per command, so shells sharing the file do not interleave
+    if (history_fd != -1) {
+        struct iovec iov[2] = { { (void *)command, len }, { "\n", 1 } };
+        if (writev(history_fd, iov, 2) == -1) {
+            perror("history file");
+            close(history_fd);
+            history_fd = -1;
         }
-        history_count--;
     }
-    history[history_count++] = strdup(command);
 }
 
+// Reads the history file, $HISTFILE or ~/.siu_history, and opens it for
+// appending. The file is mapped and only its last HISTSIZE lines are
+// touched, the entries point straight into the mapping. When most of the
+// file is older than that, its tail is rewritten to a new file.
+void load_history(void) {
+    const char *size = getenv("HISTSIZE");
+    history_size = size != NULL && atoi(size) > 0 ? atoi(size) : HISTORY_SIZE;
+    history = calloc(history_size, sizeof(history_entry));
+    if (history == NULL) {
+        perror("calloc");
+        exit(1);
+    }
 
-// Show history
-void show_history(void) {
-    for (int i = 0; i < history_count; i++) {
-        printf("%d: %s\n", i + 1, history[i]);
+    char path[PATH_MAX];
+    const char *file = getenv("HISTFILE");
+    if (file == NULL) {
+        const char *home = getenv("HOME");
+        if (home == NULL) return;
+        snprintf(path, sizeof(path), "%s/.siu_history", home);
+        file = path;
+    }
+
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            // Walk back from the end to the start of the last history_size lines
+            const char *start = map + st.st_size;
+            int lines = 0;
+            if (start[-1] == '\n') start--;
+            while (start > map && lines < history_size) {
+                const char *nl = memrchr(map, '\n', start - map);
+                const char *line = nl ? nl + 1 : map;
+                if (start > line) lines++;
+                start = nl ? nl : map;
+            }
+            if (start > map) start++; // skip the newline before the first line kept
+
+            const char *end = map + st.st_size;
+            for (const char *line = start; line < end; ) {
+                const char *nl = memchr(line, '\n', end - line);
+                int len = (nl ? nl : end) - line;
+                if (len > 0) history_push(line, len, false);
+                line = nl ? nl + 1 : end;
+            }
+
+            // Rewrite the file when over half of it has dropped out of the ring
+            if (start - map > st.st_size / 2 && st.st_size > 65536) {
+                char tmp[PATH_MAX + 8];
+                snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+                int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                if (out != -1 && write(out, start, end - start) == end - start && close(out) == 0) {
+                    rename(tmp, file);
+                } else {
+                    if (out != -1) close(out);
+                    unlink(tmp);
+                }
+            }
+        }
     }
+    if (fd != -1) close(fd);
+
+    history_fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
 }
 
+// Expands !!, !N or !prefix at the start of a line, the rest of the line
+// is kept. Returns a new line, or NULL if no command matches.
+char *expand_history(const char *line) {
+    const char *rest;
+    history_entry *e = NULL;
 
-// Main function to handle user input and execute commands
-int main() {
-    char buffer[MAX_VAL];
-    signal(SIGINT, handle_sigint);
+    if (line[1] == '!') {
+        rest = line + 2;
+        if (history_count > 0) e = history_at(history_count - 1);
+    } else if (isdigit((unsigned char)line[1])) {
+        char *end;
+        long n = strtol(line + 1, &end, 10);
+        rest = end;
+        long first = history_total - history_count + 1;
+        if (n >= first && n <= history_total) e = history_at(n - first);
+    } else {
+        rest = line + 1 + strcspn(line + 1, " \t|;&<>");
+        int len = rest - (line + 1);
+        for (int i = history_count - 1; i >= 0 && e == NULL; i--) {
+            history_entry *h = history_at(i);
+            if (h->len >= len && strncmp(h->text, line + 1, len) == 0) e = h;
+        }
+    }
+    if (e == NULL) {
+        printf("%.*s: event not found\n", (int)(rest - line), line);
+        return NULL;
+    }
+
+    size_t rest_len = strlen(rest);
+    char *expanded = malloc(e->len + rest_len + 1);
+    memcpy(expanded, e->text, e->len);
+    memcpy(expanded + e->len, rest, rest_len + 1);
+    return expanded;
+}
+
+
+// Show history, only the last count entries if count > 0
+void show_history(int count) {
+    int from = count > 0 && count < history_count ? history_count - count : 0;
+    long first = history_total - history_count + 1;
+    for (int i = from; i < history_count; i++) {
+        history_entry *e = history_at(i);
+        printf("%ld: %.*s\n", first + i, e->len, e->text);
+    }
+}
+
+
+// Redraws the Ctrl-R prompt with the current match
+void draw_search(const char *query, int len, long match, bool failed) {
+    printf("\r\033[K(%sreverse-i-search)`%.*s': ", failed ? "failed " : "", len, query);
+    if (match > 0) {
+        history_entry *e = history_at(match - (history_total - history_count + 1));
+        printf("%.*s", e->len, e->text);
+    }
+    fflush(stdout);
+}
+
+// Reads and drops the rest of an escape sequence such as an arrow key
+void skip_escape(void) {
+    unsigned char c;
+    if (read(STDIN_FILENO, &c, 1) != 1 || (c != '[' && c != 'O')) return;
+    while (read(STDIN_FILENO, &c, 1) == 1 && !(c >= 0x40 && c <= 0x7e));
+}
+
+// Ctrl-R incremental search. Each key narrows the query or, for another
+// Ctrl-R, moves to an older match. Enter returns true to run the match, any
+// other key puts the match on the line for editing, Ctrl-G or Ctrl-C leaves
+// the line as it was.
+bool reverse_search(char **line, size_t *len, size_t *cap) {
+    if (!history_indexed) {
+        build_history_index();
+    }
+    char query[256];
+    int qlen = 0;
+    long match = 0;
+    bool failed = false;
+    draw_search(query, qlen, match, failed);
+
+    unsigned char c;
+    while (read(STDIN_FILENO, &c, 1) == 1) {
+        if (c == 7 || c == 3) {
+            return false;
+        } else if (c == 18) {
+            long older = qlen > 0 ? search_history(query, qlen, match ? match : history_total + 1) : 0;
+            if (older > 0) match = older;
+            else failed = qlen > 0;
+        } else if (c == 127 || c == 8) {
+            if (qlen > 0) qlen--;
+            match = qlen > 0 ? search_history(query, qlen, history_total + 1) : 0;
+            failed = qlen > 0 && match == 0;
+        } else if (c >= 32 && c != 127) {
+            if (qlen < (int)sizeof(query)) {
+                query[qlen++] = c;
+            }
+            if (!failed) {
+                // The current match may still contain the longer query
+                long found = search_history(query, qlen, match ? match + 1 : history_total + 1);
+                if (found > 0) match = found;
+                else failed = true;
+            }
+        } else {
+            if (c == 27) skip_escape();
+            if (match > 0) {
+                history_entry *e = history_at(match - (history_total - history_count + 1));
+                if ((size_t)e->len + 1 > *cap) {
+                    *cap = e->len + 1;
+                    *line = realloc(*line, *cap);
+                }
+                memcpy(*line, e->text, e->len);
+                *len = e->len;
+            }
+            return c == '\r' || c == '\n';
+        }
+        draw_search(query, qlen, match, failed);
+    }
+    return false;
+}
+
+// Reads a line from a terminal with the terminal in raw mode, so Ctrl-R can
+// search the history. Handles typing, backspace, Ctrl-U to clear the line,
+// Ctrl-C to drop it and Ctrl-D to quit on an empty line. Returns the line,
+// or NULL at end of input.
+char *read_line(const char *prompt) {
+    struct termios saved, raw;
+    if (tcgetattr(STDIN_FILENO, &saved) == -1) {
+        return NULL;
+    }
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    size_t cap = 128, len = 0;
+    char *line = malloc(cap);
+    printf("%s", prompt);
+    fflush(stdout);
 
     while (true) {
-        printf("siu> ");  
-        if (fgets(buffer, MAX_VAL, stdin) == NULL) {
+        unsigned char c;
+        ssize_t got = read(STDIN_FILENO, &c, 1);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got != 1 || (c == 4 && len == 0)) {
+            printf("\n");
+            free(line);
+            line = NULL;
             break;
         }
+        if (c == '\r' || c == '\n') {
+            printf("\n");
+            break;
+        } else if (c == 3) {
+            printf("^C\n%s", prompt);
+            len = 0;
+        } else if (c == 127 || c == 8) {
+            // Drop a whole UTF-8 character
+            while (len > 0 && ((unsigned char)line[len - 1] & 0xc0) == 0x80) len--;
+            if (len > 0) len--;
+            printf("\r\033[K%s%.*s", prompt, (int)len, line);
+        } else if (c == 21) {
+            len = 0;
+            printf("\r\033[K%s", prompt);
+        } else if (c == 18) {
+            bool run = reverse_search(&line, &len, &cap);
+            printf("\r\033[K%s%.*s", prompt, (int)len, line);
+            if (run) {
+                printf("\n");
+                break;
+            }
+        } else if (c == 27) {
+            skip_escape();
+        } else if (c >= 32 || c == '\t') {
+            if (len + 2 > cap) {
+                cap *= 2;
+                line = realloc(line, cap);
+            }
+            line[len++] = c;
+            printf("%c", c);
+        }
+        fflush(stdout);
+    }
+    fflush(stdout);
+    if (line != NULL) line[len] = '\0';
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    return line;
+}
+
+
+// Main function to handle user input and execute commands.
+// siu script.sh runs a script, siu -c 'commands' runs a string.
+int main(int argc, char *argv[]) {
+    // Background jobs are reaped as they finish, in every mode
+    struct sigaction chld;
+    memset(&chld, 0, sizeof(chld));
+    chld.sa_handler = handle_sigchld;
+    chld.sa_flags = SA_RESTART;
+    sigemptyset(&chld.sa_mask);
+    sigaction(SIGCHLD, &chld, NULL);
+
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        return run_script(argv[2]);
+    } else if (argc > 1) {
+        char *text = read_script(argv[1]);
+        if (text == NULL) {
+            perror(argv[1]);
+            return 127;
+        }
+        int status = run_script(text);
+        free(text);
+        return status;
+    }
+
+    char *buffer = NULL;
+    size_t cap = 0;
+    signal(SIGINT, handle_sigint);
+    load_history();
+    bool terminal = isatty(STDIN_FILENO);
+    if (terminal) {
+        start_job_control();
+    }
+
+    while (true) {
+        report_jobs();
+        if (terminal) {
+            free(buffer);
+            buffer = read_line("siu> ");
+            if (buffer == NULL) {
+                break;
+            }
+            cap = strlen(buffer) + 1;
+        } else {
+            printf("siu> ");  
+            if (getline(&buffer, &cap, stdin) == -1) {
+                break;
+            }
+        }
 
         buffer[strcspn(buffer, "\n")] = '\0';  // Remove newline
 
         // Checking for history command
-        if (buffer[0] == '!' && isdigit(buffer[1])) {
-            int idx = atoi(buffer + 1) - 1;
-            if (idx >= 0 && idx < history_count) {
-                strcpy(buffer, history[idx]);
-                printf("Executing command from history: %s\n", buffer);
-            } else {
-                printf("Invalid history index\n");
+        if (buffer[0] == '!' && buffer[1] != '\0' && !isspace((unsigned char)buffer[1])) {
+            char *expanded = expand_history(buffer);
+            if (expanded == NULL) {
                 continue;
             }
+            free(buffer);
+            buffer = expanded;
+            cap = strlen(buffer) + 1;
+            printf("Executing command from history: %s\n", buffer);
         }
         // Checking for empty input
         if (strlen(buffer) == 0 || buffer[0] == '\n') {
@@ -485,15 +2409,12 @@ int main() {
 
         take_input(buffer);
     }
+    free(buffer);
 
     // Free history memory
-    for (int i = 0; i < history_count; i++) {
-        free(history[i]);
-    }
+    if (history_fd != -1) close(history_fd);
+    free(history_text);
+    free(history);
 
     return 0;
 }
-
-
-
-
@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+// mkvsfs: writes a consistent VSFS image of any size for vsfsck to check, and
+// can then damage it with every kind of error vsfsck detects. Data blocks are
+// never written, so a large image is a sparse file holding only metadata and
+// indirect blocks.
+
+//File system structure, the same as vsfsck's
+#define VSFS_MAGIC       0xD34D  // Magic bytes for VSFS
+#define BLOCK_SIZE       4096    // Size of each block in bytes
+#define INODE_SIZE       256     // Size of each inode in bytes
+
+// Reference image (64 blocks, 80 inodes), only used for the default inode density
+#define TOTAL_BLOCKS     64
+#define INODE_COUNT      (5 * BLOCK_SIZE / INODE_SIZE)
+
+#define SUPERBLOCK_BLOCK_NUM     0
+#define INODES_PER_BLOCK         (BLOCK_SIZE / INODE_SIZE)
+#define BITS_PER_BLOCK           (BLOCK_SIZE * 8)
+#define POINTERS_PER_BLOCK       (BLOCK_SIZE / sizeof(uint32_t))
+#define MAX_INDIRECT_LEVEL       3
+#define DIV_ROUND_UP(n, d)       (((n) + (d) - 1) / (d))
+
+typedef struct {
+    uint16_t magic;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_bitmap_block;
+    uint32_t data_bitmap_block;
+    uint32_t inode_table_block;
+    uint32_t data_block_start;
+    uint32_t inode_size;
+    uint32_t inode_count;
+    uint8_t reserved[4058];
+} superblock_t;
+
+typedef struct {
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t size;
+    uint32_t atime;
+    uint32_t ctime;
+    uint32_t mtime;
+    uint32_t dtime;
+    uint32_t links_count;
+    uint32_t blocks_count;
+    uint32_t direct_block;
+    uint32_t single_indirect;
+    uint32_t double_indirect;
+    uint32_t triple_indirect;
+    uint8_t reserved[200];
+} inode_t;
+
+_Static_assert(sizeof(superblock_t) == BLOCK_SIZE, "superblock_t fills block 0");
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode_t must match the on-disk inode size");
+
+// Kinds of damage -c can do
+enum {
+    CORRUPT_MAGIC,               // Superblock magic
+    CORRUPT_LAYOUT,              // Superblock block size and inode size
+    CORRUPT_INODE_BITMAP,        // One free inode marked used, one used inode marked free
+    CORRUPT_DATA_BITMAP,         // One free block marked used, one used block marked free
+    CORRUPT_DUPLICATE,           // A second inode points at another file's block
+    CORRUPT_BAD_DIRECT,          // Direct pointer past the end of the image
+    CORRUPT_BAD_ROOT,            // Indirect root pointer into the metadata region
+    CORRUPT_BAD_POINTER,         // Pointer out of range inside an indirect block
+    CORRUPT_CYCLE,               // Double or triple indirect root pointing back at itself
+    CORRUPT_SHARED_TREE,         // Second pointer of a level-2 block repeating the first
+    CORRUPT_SHARED_ROOT,         // Double indirect root set to the triple indirect root
+    CORRUPT_KINDS
+};
+
+static const char *corrupt_names[CORRUPT_KINDS] = {
+    "magic", "layout", "inode-bitmap", "data-bitmap", "duplicate",
+    "bad-direct", "bad-root", "bad-pointer", "cycle", "shared-tree", "shared-root"
+};
+
+// Global variables
+int image_fd = -1;
+superblock_t superblock;
+uint8_t *inode_bitmap;               // Whole inode bitmap region
+uint8_t *data_bitmap;                // Whole data bitmap region, bit i is block data_block_start + i
+inode_t *inode_table;                // Whole inode table
+bool *touched;                       // Inodes already damaged, each kind gets its own
+uint32_t next_free;                  // Next block handed out by allocate_block()
+uint64_t rng_state = 1;
+uint32_t blocks_written = 0;         // Indirect blocks written
+
+void default_layout(superblock_t *sb, uint32_t total_blocks, uint32_t inode_count);
+uint32_t random_below(uint32_t n);
+void set_bit(uint8_t *bitmap, uint32_t bit_index);
+void clear_bit(uint8_t *bitmap, uint32_t bit_index);
+bool is_used_bit(const uint8_t *bitmap, uint32_t bit_index);
+bool write_block(uint32_t block_num, const void *buffer);
+bool read_block(uint32_t block_num, void *buffer);
+uint32_t allocate_block();
+uint32_t build_tree(int level, uint32_t *data_left);
+bool make_file(uint32_t inode_num, uint32_t blocks, bool deep);
+uint32_t pick_inode(bool valid, uint32_t min_level);
+bool corrupt(int kind);
+
+
+// Same layout vsfsck expects of an image of total_blocks blocks
+void default_layout(superblock_t *sb, uint32_t total_blocks, uint32_t inode_count) {
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = VSFS_MAGIC;
+    sb->block_size = BLOCK_SIZE;
+    sb->total_blocks = total_blocks;
+    sb->inode_size = INODE_SIZE;
+    sb->inode_count = inode_count;
+    sb->inode_bitmap_block = SUPERBLOCK_BLOCK_NUM + 1;
+    sb->data_bitmap_block = sb->inode_bitmap_block + DIV_ROUND_UP(inode_count, BITS_PER_BLOCK);
+    sb->inode_table_block = sb->data_bitmap_block + DIV_ROUND_UP(total_blocks, BITS_PER_BLOCK);
+    sb->data_block_start = sb->inode_table_block + DIV_ROUND_UP(inode_count, INODES_PER_BLOCK);
+}
+
+// xorshift64*, the same seed always gives the same image
+uint32_t random_below(uint32_t n) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return n == 0 ? 0 : (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32) % n;
+}
+
+void set_bit(uint8_t *bitmap, uint32_t bit_index) {
+    bitmap[bit_index / 8] |= 1 << (bit_index % 8);
+}
+
+void clear_bit(uint8_t *bitmap, uint32_t bit_index) {
+    bitmap[bit_index / 8] &= ~(1 << (bit_index % 8));
+}
+
+bool is_used_bit(const uint8_t *bitmap, uint32_t bit_index) {
+    return (bitmap[bit_index / 8] & (1 << (bit_index % 8))) != 0;
+}
+
+bool write_block(uint32_t block_num, const void *buffer) {
+    if (pwrite(image_fd, buffer, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE) != BLOCK_SIZE) {
+        printf("Error writing block %u\n", block_num);
+        return false;
+    }
+    return true;
+}
+
+bool read_block(uint32_t block_num, void *buffer) {
+    return pread(image_fd, buffer, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE) == BLOCK_SIZE;
+}
+
+// Next free data block, marked used in the data bitmap, 0 when the image is full
+uint32_t allocate_block() {
+    if (next_free >= superblock.total_blocks) {
+        return 0;
+    }
+    set_bit(data_bitmap, next_free - superblock.data_block_start);
+    return next_free++;
+}
+
+// Allocates an indirect block of the given level and fills it with up to
+// *data_left data blocks below it, allocated in file order right after it.
+// Returns the indirect block, 0 if the image is full.
+uint32_t build_tree(int level, uint32_t *data_left) {
+    uint32_t block_num = allocate_block();
+    if (block_num == 0) {
+        return 0;
+    }
+    uint32_t pointers[POINTERS_PER_BLOCK];
+    memset(pointers, 0, sizeof(pointers));
+    for (size_t i = 0; i < POINTERS_PER_BLOCK && *data_left > 0; i++) {
+        if (level == 1) {
+            pointers[i] = allocate_block();
+            if (pointers[i] != 0) {
+                (*data_left)--;
+            }
+        } else {
+            pointers[i] = build_tree(level - 1, data_left);
+        }
+        if (pointers[i] == 0) {
+            break;
+        }
+    }
+    blocks_written++;
+    return write_block(block_num, pointers) ? block_num : 0;
+}
+
+// Makes inode_num a file of the given number of data blocks: the direct block
+// first, then the single, double and triple indirect trees in turn. A deep file
+// keeps everything after the direct block under its triple indirect root.
+bool make_file(uint32_t inode_num, uint32_t blocks, bool deep) {
+    inode_t *inode = &inode_table[inode_num];
+    memset(inode, 0, sizeof(*inode));
+    inode->mode = 0100644;
+    inode->atime = inode->ctime = inode->mtime = 1700000000;
+    inode->links_count = 1;
+
+    uint32_t left = blocks;
+    inode->direct_block = allocate_block();
+    if (inode->direct_block == 0) {
+        memset(inode, 0, sizeof(*inode)); // Image full, the slot stays free
+        return false;
+    }
+    left--;
+
+    uint32_t *roots[MAX_INDIRECT_LEVEL] = { &inode->single_indirect, &inode->double_indirect,
+                                            &inode->triple_indirect };
+    for (int level = 1; level <= MAX_INDIRECT_LEVEL && left > 0; level++) {
+        if (deep && level < MAX_INDIRECT_LEVEL) {
+            continue;
+        }
+        *roots[level - 1] = build_tree(level, &left);
+        if (*roots[level - 1] == 0) {
+            break;
+        }
+    }
+
+    inode->blocks_count = blocks - left;
+    inode->size = inode->blocks_count * BLOCK_SIZE;
+    set_bit(inode_bitmap, inode_num);
+    return left == 0;
+}
+
+// A random inode not damaged yet that is valid or free, with at least
+// min_level indirect levels below it (0: any). Returns UINT32_MAX if there
+// is none.
+uint32_t pick_inode(bool valid, uint32_t min_level) {
+    uint32_t count = superblock.inode_count;
+    uint32_t start = random_below(count);
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t i = (start + k) % count;
+        inode_t *inode = &inode_table[i];
+        bool is_valid = inode->links_count > 0 && inode->dtime == 0;
+        if (is_valid != valid || touched[i]) {
+            continue;
+        }
+        if (min_level == 1 && inode->single_indirect == 0) {
+            continue;
+        }
+        if (min_level == 2 && inode->double_indirect == 0 && inode->triple_indirect == 0) {
+            continue;
+        }
+        if (min_level >= 3 && inode->triple_indirect == 0) {
+            continue;
+        }
+        touched[i] = true;
+        return i;
+    }
+    return UINT32_MAX;
+}
+
+// Does one kind of damage and says where, false if the image has nothing it
+// could be done to
+bool corrupt(int kind) {
+    uint32_t pointers[POINTERS_PER_BLOCK];
+    uint32_t a, b;
+
+    switch (kind) {
+    case CORRUPT_MAGIC:
+        superblock.magic = 0xBEEF;
+        printf("Corrupted: superblock magic 0x%04X\n", superblock.magic);
+        return true;
+    case CORRUPT_LAYOUT:
+        superblock.block_size = BLOCK_SIZE * 2;
+        superblock.inode_size = INODE_SIZE / 2;
+        printf("Corrupted: superblock block size %u, inode size %u\n", superblock.block_size,
+               superblock.inode_size);
+        return true;
+    case CORRUPT_INODE_BITMAP:
+        a = pick_inode(false, 0);
+        b = pick_inode(true, 0);
+        if (a == UINT32_MAX || b == UINT32_MAX) {
+            return false;
+        }
+        set_bit(inode_bitmap, a);
+        clear_bit(inode_bitmap, b);
+        printf("Corrupted: inode bitmap, free inode %u marked used, inode %u marked free\n", a, b);
+        return true;
+    case CORRUPT_DATA_BITMAP:
+        if (next_free >= superblock.total_blocks) {
+            return false;
+        }
+        a = next_free + random_below(superblock.total_blocks - next_free);
+        b = pick_inode(true, 0);
+        if (b == UINT32_MAX) {
+            return false;
+        }
+        b = inode_table[b].direct_block;
+        set_bit(data_bitmap, a - superblock.data_block_start);
+        clear_bit(data_bitmap, b - superblock.data_block_start);
+        printf("Corrupted: data bitmap, free block %u marked used, block %u marked free\n", a, b);
+        return true;
+    case CORRUPT_DUPLICATE:
+        a = pick_inode(true, 0);
+        b = pick_inode(true, 0);
+        if (a == UINT32_MAX || b == UINT32_MAX) {
+            return false;
+        }
+        // b's own direct block is left marked used but no longer referenced
+        printf("Corrupted: inode %u direct block %u -> %u, shared with inode %u\n", b,
+               inode_table[b].direct_block, inode_table[a].direct_block, a);
+        inode_table[b].direct_block = inode_table[a].direct_block;
+        return true;
+    case CORRUPT_BAD_DIRECT:
+        a = pick_inode(true, 0);
+        if (a == UINT32_MAX) {
+            return false;
+        }
+        inode_table[a].direct_block = superblock.total_blocks + random_below(1000);
+        printf("Corrupted: inode %u direct block %u\n", a, inode_table[a].direct_block);
+        return true;
+    case CORRUPT_BAD_ROOT:
+        a = pick_inode(true, 1);
+        if (a == UINT32_MAX) {
+            return false;
+        }
+        inode_table[a].single_indirect = superblock.inode_bitmap_block;
+        printf("Corrupted: inode %u single indirect block %u\n", a, inode_table[a].single_indirect);
+        return true;
+    case CORRUPT_BAD_POINTER:
+        a = pick_inode(true, 1);
+        if (a == UINT32_MAX || !read_block(inode_table[a].single_indirect, pointers)) {
+            return false;
+        }
+        b = random_below(POINTERS_PER_BLOCK);
+        pointers[b] = superblock.total_blocks + random_below(1000);
+        printf("Corrupted: inode %u single indirect block %u, pointer %u -> %u\n", a,
+               inode_table[a].single_indirect, b, pointers[b]);
+        return write_block(inode_table[a].single_indirect, pointers);
+    case CORRUPT_CYCLE:
+        // The last pointer of a root above level 1 leads back to the root
+        a = pick_inode(true, 2);
+        if (a == UINT32_MAX) {
+            return false;
+        }
+        b = inode_table[a].double_indirect ? inode_table[a].double_indirect : inode_table[a].triple_indirect;
+        if (!read_block(b, pointers)) {
+            return false;
+        }
+        pointers[POINTERS_PER_BLOCK - 1] = b;
+        printf("Corrupted: inode %u indirect block %u points back to itself\n", a, b);
+        return write_block(b, pointers);
+    case CORRUPT_SHARED_TREE:
+        // The whole subtree below the first level-1 block is then reached twice
+        a = pick_inode(true, 3);
+        if (a == UINT32_MAX || !read_block(inode_table[a].triple_indirect, pointers) || pointers[0] == 0) {
+            return false;
+        }
+        b = pointers[0];
+        if (!read_block(b, pointers) || pointers[0] == 0) {
+            return false;
+        }
+        printf("Corrupted: inode %u level-2 block %u, pointer 1 %u -> %u\n", a, b, pointers[1], pointers[0]);
+        pointers[1] = pointers[0];
+        return write_block(b, pointers);
+    case CORRUPT_SHARED_ROOT:
+        a = pick_inode(true, 3);
+        if (a == UINT32_MAX) {
+            return false;
+        }
+        inode_table[a].double_indirect = inode_table[a].triple_indirect;
+        printf("Corrupted: inode %u double indirect root %u, shared with its triple indirect root\n", a,
+               inode_table[a].double_indirect);
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t total_blocks = TOTAL_BLOCKS;
+    uint32_t inode_count = 0;
+    uint32_t used_percent = 50;
+    uint32_t file_blocks = 4;
+    uint32_t deep_files = 0;
+    bool corruptions[CORRUPT_KINDS] = { false };
+    bool all_kinds = false;              // -c all: kinds the image is too small for are skipped
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "-b") == 0 && value != NULL) {
+            total_blocks = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-i") == 0 && value != NULL) {
+            inode_count = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-u") == 0 && value != NULL) {
+            used_percent = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-f") == 0 && value != NULL) {
+            file_blocks = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-d") == 0 && value != NULL) {
+            deep_files = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-s") == 0 && value != NULL) {
+            rng_state = strtoull(argv[++i], NULL, 0) * 2 + 1;
+        } else if (strcmp(argv[i], "-c") == 0 && value != NULL) {
+            i++;
+            bool known = false;
+            all_kinds = all_kinds || strcmp(argv[i], "all") == 0;
+            for (int k = 0; k < CORRUPT_KINDS; k++) {
+                if (strcmp(argv[i], "all") == 0 || strcmp(argv[i], corrupt_names[k]) == 0) {
+                    corruptions[k] = true;
+                    known = true;
+                }
+            }
+            if (!known) {
+                printf("Unknown corruption: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL) {
+        printf("Usage: %s [-b blocks] [-i inodes] [-u used%%] [-f blocks per file] [-d deep files] [-s seed]\n"
+               "       [-c magic|layout|inode-bitmap|data-bitmap|duplicate|bad-direct|bad-root|bad-pointer|cycle|\n"
+               "           shared-tree|shared-root|all]... image\n",
+               argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Same inode density as the reference image unless -i is given
+    if (inode_count == 0) {
+        uint64_t count = (uint64_t)total_blocks * INODE_COUNT / TOTAL_BLOCKS;
+        count = DIV_ROUND_UP(count, INODES_PER_BLOCK) * INODES_PER_BLOCK;
+        inode_count = count > 0 ? (uint32_t)count : INODES_PER_BLOCK;
+    }
+    default_layout(&superblock, total_blocks, inode_count);
+    if (superblock.data_block_start >= total_blocks || used_percent > 100 || file_blocks == 0) {
+        printf("%u blocks cannot hold %u inodes and any data\n", total_blocks, inode_count);
+        return EXIT_FAILURE;
+    }
+
+    size_t inode_bitmap_size = (size_t)(superblock.data_bitmap_block - superblock.inode_bitmap_block) * BLOCK_SIZE;
+    size_t data_bitmap_size = (size_t)(superblock.inode_table_block - superblock.data_bitmap_block) * BLOCK_SIZE;
+    size_t table_size = (size_t)(superblock.data_block_start - superblock.inode_table_block) * BLOCK_SIZE;
+    inode_bitmap = calloc(1, inode_bitmap_size);
+    data_bitmap = calloc(1, data_bitmap_size);
+    inode_table = calloc(1, table_size);
+    touched = calloc(inode_count, sizeof(bool));
+    if (inode_bitmap == NULL || data_bitmap == NULL || inode_table == NULL || touched == NULL) {
+        printf("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    image_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (image_fd == -1 || ftruncate(image_fd, (off_t)total_blocks * BLOCK_SIZE) != 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    // Files of 1 to 2 * file_blocks - 1 blocks in random inode slots, laid out
+    // one after another until they take used_percent of the data blocks, deep
+    // files not counted. Every
+    // eighth free slot holds a deleted file whose stale pointers vsfsck has to
+    // ignore.
+    uint32_t data_blocks = total_blocks - superblock.data_block_start;
+    uint64_t target = (uint64_t)data_blocks * used_percent / 100;
+    uint64_t wanted_files = DIV_ROUND_UP(target, file_blocks) + deep_files;
+    uint32_t chance = wanted_files >= inode_count ? 1000 : (uint32_t)(wanted_files * 1000 / inode_count) + 1;
+    next_free = superblock.data_block_start;
+    uint32_t files = 0, deleted = 0, deep_made = 0, deep_blocks = 0;
+    bool full = false;
+    for (uint32_t i = 0; i < inode_count && !full && next_free - superblock.data_block_start - deep_blocks < target; i++) {
+        if (random_below(1000) >= chance) {
+            if (random_below(8) == 0) {
+                inode_t *inode = &inode_table[i];
+                inode->mode = 0100644;
+                inode->dtime = 1700000001;
+                inode->direct_block = superblock.data_block_start + random_below(data_blocks);
+                inode->single_indirect = total_blocks + random_below(1000);
+                deleted++;
+            }
+            continue;
+        }
+        bool deep = deep_made < deep_files;
+        uint32_t blocks = 1 + random_below(2 * file_blocks - 1);
+        if (deep) {
+            blocks += POINTERS_PER_BLOCK; // Enough to fill more than one single indirect block
+        }
+        uint32_t before = next_free;
+        full = !make_file(i, blocks, deep);
+        if (deep) {
+            deep_blocks += next_free - before;
+        }
+        if (inode_table[i].links_count > 0) {
+            files++;
+            deep_made += deep;
+        }
+    }
+
+    // Kinds that need an inode with indirect trees pick first
+    bool ok = true;
+    for (int k = CORRUPT_KINDS - 1; k >= 0; k--) {
+        if (corruptions[k] && !corrupt(k)) {
+            printf("Could not corrupt %s: no suitable inode\n", corrupt_names[k]);
+            ok = ok && all_kinds;
+        }
+    }
+
+    // Metadata region in one go
+    ok = ok && write_block(SUPERBLOCK_BLOCK_NUM, &superblock);
+    ok = ok && pwrite(image_fd, inode_bitmap, inode_bitmap_size,
+                      (off_t)superblock.inode_bitmap_block * BLOCK_SIZE) == (ssize_t)inode_bitmap_size;
+    ok = ok && pwrite(image_fd, data_bitmap, data_bitmap_size,
+                      (off_t)superblock.data_bitmap_block * BLOCK_SIZE) == (ssize_t)data_bitmap_size;
+    ok = ok && pwrite(image_fd, inode_table, table_size,
+                      (off_t)superblock.inode_table_block * BLOCK_SIZE) == (ssize_t)table_size;
+    ok = ok && fsync(image_fd) == 0;
+    close(image_fd);
+
+    printf("%s: %u blocks, %u inodes, %u files (%u deep), %u deleted, %u blocks used, %u indirect blocks%s\n",
+           path, total_blocks, inode_count, files, deep_made, deleted,
+           next_free - superblock.data_block_start, blocks_written, full ? ", image full" : "");
+    free(inode_bitmap);
+    free(data_bitmap);
+    free(inode_table);
+    free(touched);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,77 @@
+#!/bin/sh
+# Checks that one vsfsck repair is enough: every kind of corruption mkvsfs
+# can make, alone and all together, is repaired and a second run with -n
+# finds the image consistent. Images are a quarter full, so copying shared
+# trees never runs out of free blocks. Each case runs on mapped and read/write
+# images, with one and several walk threads. Clean images whose inodes end
+# partway through a bitmap word must also check clean on several threads.
+#
+#   ./test_vsfsck.sh [-s "seeds ..."] [-b blocks] [-- vsfsck options]
+
+set -e
+
+seeds="1 2 3"
+blocks=8192
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+    -s) seeds=$2; shift 2 ;;
+    -b) blocks=$2; shift 2 ;;
+    --) shift; break ;;
+    *) echo "Usage: $0 [-s \"seeds ...\"] [-b blocks] [-- vsfsck options]" >&2
+       exit 1 ;;
+    esac
+done
+
+src=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc -O2 -pthread -o "$work/vsfsck" "$src/vsfsck_project2.c"
+gcc -O2 -o "$work/mkvsfs" "$src/mkvsfs.c"
+cd "$work"
+
+kinds="magic layout inode-bitmap data-bitmap duplicate bad-direct bad-root bad-pointer cycle
+       shared-tree shared-root all"
+failed=0
+cases=0
+for seed in $seeds; do
+    for kind in $kinds; do
+        for mode in "-j 1" "-j 4" "--no-mmap -j 1" "--no-mmap -j 4"; do
+            rm -f vsfs.img vsfs.img.journal
+            ./mkvsfs -b "$blocks" -u 25 -d 2 -s "$seed" -c $kind vsfs.img > mkvsfs.log ||
+                { cat mkvsfs.log >&2; exit 1; }
+            cases=$((cases + 1))
+            status=0
+            ./vsfsck $mode "$@" > repair.log || status=$?
+            if [ $status -ne 0 ]; then
+                echo "FAIL seed $seed, $kind, $mode: repair exited with $status"
+                failed=$((failed + 1))
+            elif ! ./vsfsck -n > recheck.log; then
+                echo "FAIL seed $seed, $kind, $mode: second run still finds errors"
+                grep '^Error' recheck.log | head -5
+                failed=$((failed + 1))
+            fi
+        done
+    done
+done
+
+# Consistent images whose inode count is not a multiple of 64, with every
+# inode used, so the last valid_inodes word is partly full
+for seed in $seeds; do
+    for inodes in 80 100 300; do
+        for threads in 3 4 8; do
+            ./mkvsfs -b 4096 -i $inodes -u 100 -f 1 -s "$seed" vsfs.img > mkvsfs.log ||
+                { cat mkvsfs.log >&2; exit 1; }
+            cases=$((cases + 1))
+            if ! ./vsfsck -n -j $threads "$@" > recheck.log; then
+                echo "FAIL seed $seed, $inodes inodes, -j $threads: clean image has errors"
+                grep '^Error' recheck.log | head -5
+                failed=$((failed + 1))
+            fi
+        done
+    done
+done
+
+echo "$cases cases, $failed failed"
+[ $failed -eq 0 ]
@@ -1,26 +1,58 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
 #include <time.h>
 #include <fcntl.h>     
 #include <unistd.h>    
 #include <sys/types.h> 
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE      // linux/fs.h has its own, VSFS uses the one below
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL 1
+#endif
 
 //File system structure
 #define VSFS_MAGIC       0xD34D  // Magic bytes for VSFS
 #define BLOCK_SIZE       4096    // Size of each block in bytes
-#define TOTAL_BLOCKS     64      // Total number of blocks in file system
 #define INODE_SIZE       256     // Size of each inode in bytes
-#define INODE_COUNT      (5 * BLOCK_SIZE / INODE_SIZE)  // Number of inodes (80)
 
-// Block numbers
+// Reference image (64 blocks, 80 inodes), only used for the default inode density
+#define TOTAL_BLOCKS     64      // Total number of blocks in the reference image
+#define INODE_COUNT      (5 * BLOCK_SIZE / INODE_SIZE)  // Number of inodes in the reference image (80)
+
+// Block numbers, the rest of the layout comes from the superblock
 #define SUPERBLOCK_BLOCK_NUM     0   // Block number for superblock
-#define INODE_BITMAP_BLOCK_NUM   1   // Block number for inode bitmap
-#define DATA_BITMAP_BLOCK_NUM    2   // Block number for data bitmap
-#define INODE_TABLE_START_BLOCK  3   // Start block number for inode table
-#define DATA_BLOCK_START         8   // Start block number for data blocks
+#define INODES_PER_BLOCK         (BLOCK_SIZE / INODE_SIZE)  // Inodes per table block (16)
+#define BITS_PER_BLOCK           (BLOCK_SIZE * 8)           // Bitmap bits per block
+
+#define DIV_ROUND_UP(n, d)       (((n) + (d) - 1) / (d))
+#define MAX_THREADS              256                        // Upper bound for -j
+#define POINTERS_PER_BLOCK       (BLOCK_SIZE / sizeof(uint32_t)) // Block pointers in an indirect block
+#define MAX_INDIRECT_LEVEL       3                          // Triple indirect
+#define READAHEAD_WINDOW         64                         // Indirect blocks read ahead per stack level
+#define JOURNAL_MAGIC            "VSFSJNL1"                 // First bytes of a fix journal
+#define JOURNAL_PENDING          1                          // Journal written, image not known to be updated
+#define JOURNAL_APPLIED          2                          // Image updated, journal kept for --rollback
+#define REPORT_VERSION           1                          // Version of the JSON and binary reports
+#define PREFETCH_RUN             64                         // Most indirect blocks read by one prefetch pread
+#define EXIT_UNCORRECTED         4                          // Exit status when errors are left in the image
 
 // Superblock structure
 typedef struct {
@@ -52,23 +84,335 @@ typedef struct {
     uint32_t single_indirect;    // Single indirect block pointer
     uint32_t double_indirect;    // Double indirect block pointer
     uint32_t triple_indirect;    // Triple indirect block pointer
-    uint8_t reserved[156];       // Reserved space
+    uint8_t reserved[200];       // Reserved space (pads the inode to INODE_SIZE)
 } inode_t;
 
-// Global variables
-char *fs_image_path = "vsfs.img";   // Path to the file system image
-int fs_fd = -1;                     // File descriptor for the file system image
-superblock_t superblock;            // Superblock of the file system
-uint8_t inode_bitmap[BLOCK_SIZE];   // Inode bitmap
-uint8_t data_bitmap[BLOCK_SIZE];    // Data bitmap
-bool used_blocks[TOTAL_BLOCKS];     // Tracks blocks used by inodes
-bool duplicated_blocks[TOTAL_BLOCKS]; // Tracks duplicated blocks
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode_t must match the on-disk inode size");
+
+// Kinds of finding, the BAD_* ones come from the block walk
+enum {
+    BAD_DIRECT,                  // Direct pointer out of range
+    BAD_INDIRECT_ROOT,           // Single/double/triple indirect pointer in the inode out of range
+    BAD_CYCLE,                   // Indirect block points back at one of its ancestors
+    BAD_INDIRECT_READ,           // Indirect block could not be read
+    BAD_POINTER,                 // Pointer out of range inside an indirect block
+    SB_READ,                     // Superblock could not be read
+    SB_MAGIC,                    // Superblock fields, value holds the field and expected what it should be
+    SB_BLOCK_SIZE,
+    SB_TOTAL_BLOCKS,
+    SB_INODE_BITMAP_BLOCK,
+    SB_DATA_BITMAP_BLOCK,
+    SB_INODE_TABLE_BLOCK,
+    SB_DATA_BLOCK_START,
+    SB_INODE_SIZE,
+    SB_INODE_COUNT,
+    INODE_BITMAP_READ,           // Inode bitmap could not be read
+    INODE_MARKED_INVALID,        // Invalid inode marked as used
+    INODE_VALID_UNMARKED,        // Valid inode not marked as used
+    DATA_BITMAP_READ,            // Data bitmap could not be read
+    BLOCK_MARKED_UNUSED,         // Block marked as used but not referenced
+    BLOCK_USED_UNMARKED,         // Block referenced but not marked as used
+    DUPLICATE_BLOCK,             // One reference to a block referenced more than once, value = references
+    FINDING_KINDS
+};
+
+// One finding, the block walk keeps them so threads can report in inode order
+typedef struct {
+    int kind;                    // One of the kinds above
+    int inode;                   // Inode holding the reference, -1 if none
+    uint32_t block;              // Offending block number
+    int level;                   // Indirection level (1 = single indirect)
+    uint32_t parent;             // Indirect block holding the pointer, 0 for the inode
+    uint32_t value;              // Value found, for superblock fields and duplicates
+    uint32_t expected;           // Value expected, for superblock fields
+} finding_t;
+
+// Output formats selected with --format
+enum {
+    FORMAT_TEXT,                 // Human readable, the default
+    FORMAT_JSON,                 // One JSON document at the end
+    FORMAT_BINARY,               // Stream of report_record_t
+    FORMAT_NONE                  // Nothing, --batch prints one line per image
+};
+
+// Timed phases of a pass
+enum {
+    PHASE_LOAD,                  // Open, journal recovery, metadata
+    PHASE_WALK,                  // Block reference walk
+    PHASE_SUPERBLOCK,
+    PHASE_INODE_BITMAP,
+    PHASE_DATA_BITMAP,
+    PHASE_DUPLICATES,
+    PHASE_BAD_BLOCKS,
+    PHASE_FIX,
+    PHASE_COUNT
+};
+
+// Record types of the binary report
+enum {
+    REC_HEADER,                  // block = total blocks, v[0] = format version, v[1] = inode count, v[2] = block size
+    REC_FINDING,                 // kind = finding kind, v[0] = value, v[1] = expected
+    REC_COUNT,                   // kind = error category (superblock, inode bitmap, data bitmap, duplicates, bad blocks), v[0] = errors
+    REC_PHASE,                   // kind = phase, v[0] = wall ns, v[1] = CPU ns, v[2] = bytes read
+    REC_END                      // v[0] = errors left after the last pass
+};
+
+// One binary report record, host byte order
+typedef struct {
+    uint8_t type;                // REC_*
+    uint8_t kind;
+    uint8_t pass;                // 0 = check, 1 = recheck after fixes
+    uint8_t level;
+    int32_t inode;
+    uint32_t block;
+    uint32_t parent;
+    uint64_t v[3];
+} report_record_t;
+
+_Static_assert(sizeof(report_record_t) == 40, "binary report records are 40 bytes");
+
+// A run of consecutive blocks [first, end). Block references are kept as
+// lists of extents, so contiguous files cost one entry however long they are.
+typedef struct {
+    uint32_t first;
+    uint32_t end;
+} extent_t;
+
+// One reference to a block that is referenced more than once
+typedef struct {
+    uint32_t block;              // Duplicated block
+    int inode;                   // Inode referencing it, listed once per reference
+} block_owner_t;
+
+// Header block of the fix journal. It is followed by the block number table
+// (padded to whole blocks), the old contents (undo) and the new contents (redo)
+// of every block the repair changes, each block aligned to BLOCK_SIZE.
+typedef struct {
+    char magic[8];               // JOURNAL_MAGIC
+    uint32_t state;              // JOURNAL_PENDING or JOURNAL_APPLIED
+    uint32_t block_size;         // BLOCK_SIZE
+    uint32_t count;              // Blocks in the transaction
+    uint32_t image_blocks;       // Image size the journal was written for
+    uint64_t checksum;           // FNV-1a of the table, undo and redo blocks
+} journal_header_t;
+
+// A data block written by a fix on the read/write path, kept until commit
+typedef struct {
+    uint32_t block;              // 0 marks a free hash slot (block 0 is the superblock)
+    uint8_t *data;
+} staged_block_t;
+
+// One indirect block on the explicit walk stack
+typedef struct {
+    uint32_t block;              // Indirect block being scanned
+    int level;                   // Its level, 1 = pointers are data blocks
+    int next;                    // Next pointer slot to look at
+    const uint32_t *pointers;    // Block contents, in place or in a pool buffer
+} walk_frame_t;
+
+// Indirect blocks queued for reading ahead of the walk, in pointer order
+typedef struct {
+    uint32_t block[READAHEAD_WINDOW]; // Queued blocks
+    bool done[READAHEAD_WINDOW];      // Read finished (always true without io_uring)
+    bool ok[READAHEAD_WINDOW];        // Read finished with a whole block in buf
+    int count;                   // Blocks queued in this window
+    int head;                    // Next queued block the walk will reach
+    int scan;                    // Frame pointer slot the next window starts at
+    int in_flight;               // io_uring reads not yet completed
+    uint32_t (*buf)[POINTERS_PER_BLOCK]; // One buffer per queued block, NULL when mapped
+} readahead_t;
+
+#ifdef HAVE_IO_URING
+// io_uring instance of one walker, driven with raw system calls
+typedef struct {
+    int fd;                      // -1 when io_uring is not used
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending;            // SQEs filled in but not submitted yet
+} uring_t;
+#endif
+
+// The fields of the inode table the checks read, one array per field, padded
+// with free inodes to a multiple of 64 so the kernels never handle a tail
+typedef struct {
+    uint32_t *links_count;
+    uint32_t *dtime;
+    uint32_t *direct_block;
+    uint32_t *roots[MAX_INDIRECT_LEVEL]; // Single, double and triple indirect
+    size_t count;                // Inodes in each column
+} inode_columns_t;
+
+// Per-thread state of the block reference walk over one inode range
+typedef struct {
+    struct fsck_image *image;    // Image being walked
+    int first_inode;             // Inodes [first_inode, end_inode) are walked
+    int end_inode;
+    extent_t *extents;           // References made from this range, in walk order
+    size_t extent_count;
+    size_t extent_cap;
+    finding_t *findings;         // Bad references, in inode order
+    size_t finding_count;
+    size_t finding_cap;
+    bool collect_owners;         // Owner pass: list references to duplicated blocks instead of counting
+    block_owner_t *owners;       // Owner pass results, in inode order
+    size_t owner_count;
+    size_t owner_cap;
+    walk_frame_t stack[MAX_INDIRECT_LEVEL]; // Explicit stack of the indirect walk
+    uint32_t (*pool)[POINTERS_PER_BLOCK];   // One read buffer per stack level, reused for every inode
+    readahead_t ahead[MAX_INDIRECT_LEVEL - 1]; // Children being read ahead of the frames with level > 1
+#ifdef HAVE_IO_URING
+    uring_t ring;                // Asynchronous read-ahead, ring.fd is -1 when not used
+#endif
+    uint64_t *visited;           // Indirect blocks already walked for the current inode
+    uint64_t *visited_twice;     // Indirect blocks walked a second time for the current inode
+    uint32_t *visited_list;      // Bits set in visited, cleared after each inode
+    size_t visited_count;
+    size_t visited_cap;
+    bool out_of_memory;
+} walker_t;
+
+// One image being checked: the open image, its metadata, the walk results,
+// the error counts and the report. main() checks one, --batch one per worker
+// at a time.
+typedef struct fsck_image {
+    const char *path;            // Path to the file system image
+    char journal[4096];          // <path>.journal
+    int fd;                      // File descriptor for the file system image
+    int format;                  // Report format, FORMAT_NONE in batch mode
+    int threads;                 // Block walk threads
+    uint8_t *map;                // Whole image mapped with mmap, NULL on the read/write path
+    size_t map_size;             // Size of the mapping in bytes
+    uint32_t image_blocks;       // Blocks actually present in the image file
+    uint8_t *meta_cache;         // Metadata blocks when the image is not mapped
+    bool *meta_read_ok;          // Metadata blocks that could be read
+    uint64_t *dirty_blocks;      // Blocks changed by fixes and not committed yet, any block of the image
+    size_t dirty_map_words;      // 64-bit words in dirty_blocks
+    staged_block_t *staged;      // Data blocks written by fixes on the read/write path, open addressing
+    size_t staged_cap;           // Slots in staged, a power of two
+    size_t staged_count;
+    int report_pass;             // 0 while checking, 1 while rechecking after fixes
+    uint64_t bytes_read;         // Image bytes read, updated atomically by walk threads
+    report_record_t *report_records; // Records kept for the JSON report
+    size_t report_record_count;
+    size_t report_record_cap;
+    int current_phase;           // Phase being timed, -1 if none
+    struct timespec phase_wall_start;
+    struct timespec phase_cpu_start;
+    uint64_t phase_bytes_start;
+    uint64_t phase_wall_ns[PHASE_COUNT]; // Wall time of every phase, both passes
+    superblock_t *superblock;    // Superblock of the file system
+    uint8_t *inode_bitmap;       // Inode bitmap
+    uint8_t *data_bitmap;        // Data bitmap
+    inode_t *inode_table;        // Whole inode table
+    extent_t *used_extents;      // Referenced blocks, sorted, disjoint and joined when adjacent
+    size_t used_count;
+    size_t used_cap;
+    extent_t *dup_extents;       // Blocks referenced more than once, same form
+    size_t dup_count;
+    size_t block_map_words;      // 64-bit words in each data block bitmap
+    uint64_t *valid_inodes;      // Bitmap of inodes that pass is_valid_inode()
+    uint64_t *outlier_inodes;    // Valid inodes with a bad direct pointer or an indirect tree to walk
+    size_t inode_map_words;      // 64-bit words in valid_inodes and outlier_inodes
+    inode_columns_t inode_columns; // Inode table fields as columns, rebuilt every pass
+    block_owner_t *dup_owners;   // Owners of duplicated blocks, sorted by block
+    size_t dup_owner_count;
+    uint32_t alloc_hint;         // Next data bitmap index allocate_new_data_block() tries
+    bool tree_copied;            // fix_duplicates() copied an indirect block
+    finding_t *bad_block_findings; // Bad references from the last block walk
+    size_t bad_block_finding_count;
+
+    // Geometry the image is checked with, taken from the superblock (see derive_geometry())
+    uint32_t total_blocks;       // Total number of blocks in file system
+    uint32_t inode_count;        // Number of inodes
+    uint32_t inode_bitmap_block; // Block number for inode bitmap
+    uint32_t data_bitmap_block;  // Block number for data bitmap
+    uint32_t inode_table_block;  // Start block number for inode table
+    uint32_t data_block_start;   // Start block number for data blocks
+
+    // Errors found by the last pass
+    int superblock_errors;
+    int inode_bitmap_errors;
+    int data_bitmap_errors;
+    int duplicate_block_errors;
+    int bad_block_errors;
+    int errors_found[5];         // Errors per category found by the first pass
+} fsck_image_t;
+
+// Outcome of one batch image
+enum {
+    IMAGE_CONSISTENT,            // No errors found
+    IMAGE_REPAIRED,              // Errors found and none left after the fixes
+    IMAGE_INCONSISTENT,          // Errors left after the fixes
+    IMAGE_FAILED,                // Could not be opened or checked
+    IMAGE_RESULTS
+};
+
+// Totals of a --batch run, guarded by lock
+typedef struct {
+    pthread_mutex_t lock;
+    char **paths;                // Images to check, sorted
+    size_t count;
+    size_t next;                 // Next image a worker takes
+    size_t results[IMAGE_RESULTS]; // Images per IMAGE_* outcome
+    uint64_t errors[5];          // Errors found per category (superblock ... bad blocks)
+    uint64_t phase_wall_ns[PHASE_COUNT];
+    uint64_t bytes_read;
+} batch_t;
 
+// Global variables
+bool use_mmap = true;               // Cleared by --no-mmap to force the read/write path
+bool use_uring = true;              // Cleared by --no-uring to read ahead with preadv
+bool do_rollback = false;           // --rollback: undo the last repair from the journal and exit
+bool check_only = false;            // -n: open the image read-only and report without repairing
+int output_format = FORMAT_TEXT;    // --format=text|json|binary
+int num_threads = 1;                // Block walk threads, or images checked at once with --batch, set with -j
+__thread fsck_image_t *fs;          // Image the calling thread works on, walk threads get it from their walker
+long page_size;                     // Set by select_kernels()
+void (*classify_kernel)(size_t k, uint64_t *valid, uint64_t *outlier); // Set by select_kernels()
+size_t (*next_diff_kernel)(const uint8_t *disk, const uint64_t *a, const uint64_t *b, size_t k, size_t full);
 
 bool open_fs_image();
 void close_fs_image();
 bool read_block(int block_num, void *buffer);
 bool write_block(int block_num, void *buffer);
+const void *get_block(int block_num, void *scratch);
+void default_layout(superblock_t *sb, uint32_t total_blocks, uint32_t inode_count);
+bool layout_fits(const superblock_t *sb, uint32_t total_blocks);
+void derive_geometry(const superblock_t *sb);
+bool load_metadata();
+bool region_read_ok(uint32_t first, uint32_t end);
+bool alloc_block_tracking();
+bool commit_fs_image();
+uint8_t *stage_block(uint32_t block_num);
+const uint8_t *find_staged(uint32_t block_num);
+void free_staged();
+const void *dirty_block_data(uint32_t block_num);
+bool transfer_blocks(int fd, const uint32_t *blocks, uint8_t *const *data, size_t count, bool write);
+bool pwrite_full(int fd, const void *buffer, size_t size, off_t offset);
+uint32_t pread_blocks(void *buffer, uint32_t first, uint32_t count);
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size);
+char *journal_path();
+bool write_journal(const char *path, const uint32_t *blocks, uint8_t *const *undo, uint8_t *const *redo,
+                   size_t count);
+bool read_journal(const char *path, journal_header_t *header, uint32_t **blocks, uint8_t **undo,
+                  uint8_t **redo);
+bool recover_journal();
+bool rollback_journal();
+bool apply_journal_side(const uint32_t *blocks, uint8_t *contents, size_t count);
+void mark_block_dirty(int block_num);
+void mark_range_dirty(uint32_t first, uint32_t end);
+void mark_inode_dirty(int inode_num);
 bool check_superblock();
 bool check_inode_bitmap();
 bool check_data_bitmap();
@@ -76,486 +420,2867 @@ bool check_duplicates();
 bool check_bad_blocks();
 void print_fsck_results();
 void fix_errors();
-bool is_valid_inode(inode_t *inode);
+bool is_valid_inode(const inode_t *inode);
 bool is_used_bit(uint8_t *bitmap, int bit_index);
 void set_bit(uint8_t *bitmap, int bit_index);
 void clear_bit(uint8_t *bitmap, int bit_index);
 int allocate_new_data_block();
-void check_indirect_block(uint32_t block_num, int level, int inode_num);
-
+bool is_block_marked(const uint64_t *map, uint32_t block_num);
+bool build_valid_inode_map();
+bool build_inode_columns();
+void free_inode_columns();
+void classify_inodes();
+uint64_t load_bitmap_word(const uint8_t *bitmap, size_t k);
+uint64_t diff_word(const uint8_t *disk, const uint64_t *a, const uint64_t *b, size_t k, size_t nbits,
+                   uint64_t *on_disk);
+size_t next_diff_word(const uint8_t *disk, const uint64_t *a, const uint64_t *b, size_t k, size_t nbits);
+void select_kernels();
+void store_bitmap_words(uint8_t *disk, const uint64_t *a, const uint64_t *b, size_t nbits);
+void mark_block(uint64_t *map, uint32_t block_num);
+size_t next_bit(const uint8_t *disk, size_t from, size_t end, bool set);
+void set_bit_range(uint8_t *disk, size_t first, size_t end);
+bool grow_extents(extent_t **list, size_t *count, size_t *cap);
+bool push_extent(extent_t **list, size_t *count, size_t *cap, uint32_t first, uint32_t end);
+size_t find_extent(const extent_t *list, size_t count, uint32_t block_num);
+bool in_extents(const extent_t *list, size_t count, uint32_t block_num);
+int compare_extents(const void *a, const void *b);
+bool merge_references(walker_t *walkers, int threads);
+void add_used_block(uint32_t block_num);
+bool is_block_used(uint32_t block_num);
+void note_reference(walker_t *w, uint32_t block_num, int inode_num);
+void run_walkers(walker_t *walkers, int threads);
+int split_inode_ranges(walker_t *walkers, int threads);
+bool collect_duplicate_owners(int threads);
+size_t find_owners(uint32_t block_num, size_t *count);
+int compare_owners(const void *a, const void *b);
+int compare_ints(const void *a, const void *b);
+uint32_t claim_or_copy(uint64_t *claimed, uint32_t block_num, int inode_num, const char *block_type);
+uint32_t copy_block(uint32_t block_num, int inode_num, const char *block_type);
+bool fix_duplicate_pointer(uint64_t *claimed, uint32_t *block_ptr, int level, int inode_num, const char *block_type);
+void fix_duplicate_tree(uint64_t *claimed, uint32_t block_num, int level, int inode_num);
+void copy_duplicate_tree(uint32_t block_num, int level, int inode_num);
+void rebuild_data_bitmap();
+void cut_cycle(const finding_t *f);
+void clear_bad_pointer(const finding_t *f);
+bool fix_duplicates();
+void add_finding(walker_t *w, int kind, int inode_num, uint32_t block_num, int level, uint32_t parent);
+void print_finding(const finding_t *f);
+void say(const char *format, ...);
+void notice(const char *format, ...);
+void report(int kind, int inode_num, uint32_t block_num, int level, uint32_t parent, uint32_t value,
+            uint32_t expected);
+void report_finding(const finding_t *f);
+void emit_record(const report_record_t *r);
+void begin_phase(int phase);
+void end_phase();
+void count_read(uint64_t bytes);
+void finish_report();
+void print_json_string(const char *str);
+void print_json_pass(int pass);
+uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end);
+bool init_walker(walker_t *w);
+void free_walker(walker_t *w);
+bool visit_indirect(walker_t *w, uint32_t block_num);
+bool push_indirect(walker_t *w, int depth, uint32_t block_num, int level, int inode_num, int slot);
+void queue_readahead(walker_t *w, int depth);
+int pop_readahead(walker_t *w, int depth, uint32_t block_num);
+void wait_readahead(walker_t *w, int depth, int slot);
+void drain_readahead(walker_t *w, int depth);
+void advise_blocks(const uint32_t *blocks, int count);
+void preadv_blocks(readahead_t *ra);
+#ifdef HAVE_IO_URING
+bool uring_init(uring_t *r, unsigned entries);
+void uring_free(uring_t *r);
+void uring_queue_read(uring_t *r, void *buffer, uint32_t block_num, uint64_t user_data);
+void uring_reap(walker_t *w, unsigned min_complete);
+void uring_abandon(walker_t *w);
+#endif
+void check_indirect_block(walker_t *w, uint32_t block_num, int level, int inode_num);
+void walk_inode(walker_t *w, int inode_num);
+void *walk_inode_range(void *arg);
+bool scan_block_references();
+void prefetch_indirect_blocks();
+int compare_u64(const void *a, const void *b);
+void advise_runs(const uint64_t *entries, size_t count);
+void init_image(fsck_image_t *image, const char *path, int format, int threads);
+int check_image();
+int compare_paths(const void *a, const void *b);
+bool list_images(const char *dir, batch_t *b);
+void *batch_worker(void *arg);
+int run_batch(const char *dir);
+
+
+
+
+
+int main(int argc, char *argv[]) {
+    const char *batch_dir = NULL;
+    bool repair = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-mmap") == 0) {
+            use_mmap = false;
+        } else if (strcmp(argv[i], "--no-uring") == 0) {
+            use_uring = false;
+        } else if (strcmp(argv[i], "--rollback") == 0) {
+            do_rollback = true;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            check_only = true;
+        } else if (strcmp(argv[i], "-y") == 0) {
+            repair = true;
+        } else if (strcmp(argv[i], "--format=text") == 0) {
+            output_format = FORMAT_TEXT;
+        } else if (strcmp(argv[i], "--format=json") == 0) {
+            output_format = FORMAT_JSON;
+        } else if (strcmp(argv[i], "--format=binary") == 0) {
+            output_format = FORMAT_BINARY;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_dir = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0') {
+            num_threads = atoi(argv[i] + 2);
+        } else {
+            printf("Usage: %s [-n|-y] [--no-mmap] [--no-uring] [--rollback] [--format=text|json|binary] [-j threads]\n"
+                   "       %s --batch dir [-n|-y] [--no-mmap] [--no-uring] [-j images at once]\n",
+                   argv[0], argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (num_threads < 1 || num_threads > MAX_THREADS) {
+        printf("Thread count must be between 1 and %d\n", MAX_THREADS);
+        return EXIT_FAILURE;
+    }
 
+    if (check_only && (repair || do_rollback)) {
+        printf("-n cannot be combined with -y or --rollback\n");
+        return EXIT_FAILURE;
+    }
 
-int superblock_errors = 0;
-int inode_bitmap_errors = 0;
-int data_bitmap_errors = 0;
-int duplicate_block_errors = 0;
-int bad_block_errors = 0;
+    select_kernels();
+    if (batch_dir != NULL) {
+        if (do_rollback || output_format != FORMAT_TEXT) {
+            printf("--batch prints its own summary and cannot be combined with --rollback or --format\n");
+            return EXIT_FAILURE;
+        }
+        return run_batch(batch_dir);
+    }
 
+    fsck_image_t image;
+    init_image(&image, "vsfs.img", output_format, num_threads);
+    fs = &image;
+    int outcome = check_image();
+    if (outcome == IMAGE_FAILED) {
+        return EXIT_FAILURE;
+    }
+    return outcome == IMAGE_INCONSISTENT ? EXIT_UNCORRECTED : EXIT_SUCCESS;
+}
 
-int main() {
-    printf("VSFS Consistency Checker (vsfsck)\n");
-    printf("----------------------------------\n");
+void init_image(fsck_image_t *image, const char *path, int format, int threads) {
+    memset(image, 0, sizeof(*image));
+    image->path = path;
+    image->fd = -1;
+    image->format = format;
+    image->threads = threads;
+    image->current_phase = -1;
+}
 
-    // Initialize used and duplicated blocks arrays
-    memset(used_blocks, 0, sizeof(used_blocks));
-    memset(duplicated_blocks, 0, sizeof(duplicated_blocks));
+// Checks fs, fixes what it found and checks again (only checks with -n). Everything the image
+// allocated is released before returning, so the next image starts from nothing.
+int check_image() {
+    say("VSFS Consistency Checker (vsfsck)\n");
+    say("----------------------------------\n");
 
-    
+    begin_phase(PHASE_LOAD);
     if (!open_fs_image()) {
-        printf("Failed to open file system image: %s\n", fs_image_path);
-        return EXIT_FAILURE;
+        notice("Failed to open file system image: %s\n", fs->path);
+        end_phase();
+        return IMAGE_FAILED;
+    }
+
+    // Undo the last repair, nothing else
+    if (do_rollback) {
+        bool rolled_back = rollback_journal();
+        finish_report();
+        close_fs_image();
+        return rolled_back ? IMAGE_CONSISTENT : IMAGE_FAILED;
+    }
+
+    // Finish a repair that was interrupted after its journal was written
+    if (!recover_journal()) {
+        close_fs_image();
+        return IMAGE_FAILED;
+    }
+
+    // Superblock, bitmaps and the whole inode table in one pass, every check and fix works from here
+    if (!load_metadata()) {
+        notice("Out of memory loading metadata of %u blocks\n", fs->data_block_start);
+        close_fs_image();
+        return IMAGE_FAILED;
+    }
+    if (fs->data_block_start >= fs->total_blocks) {
+        notice("Image too small for a file system: %u blocks\n", fs->total_blocks);
+        close_fs_image();
+        return IMAGE_FAILED;
+    }
+
+    // Used and duplicated blocks arrays, sized by the image geometry
+    if (!alloc_block_tracking()) {
+        notice("Out of memory tracking %u blocks\n", fs->total_blocks);
+        close_fs_image();
+        return IMAGE_FAILED;
+    }
+    end_phase();
+
+    if (fs->format == FORMAT_BINARY) {
+        report_record_t header = { .type = REC_HEADER, .block = fs->total_blocks,
+                                   .v = { REPORT_VERSION, fs->inode_count, BLOCK_SIZE } };
+        emit_record(&header);
+    }
+
+    // Walk every inode's block tree up front, the bitmap, duplicate and bad block checks report from it
+    begin_phase(PHASE_WALK);
+    if (!scan_block_references()) {
+        notice("Out of memory walking block references\n");
+        close_fs_image();
+        return IMAGE_FAILED;
     }
+    end_phase();
 
     //Checking the file system
+    begin_phase(PHASE_SUPERBLOCK);
     bool superblock_ok = check_superblock();
+    begin_phase(PHASE_INODE_BITMAP);
     bool inode_bitmap_ok = check_inode_bitmap();
+    begin_phase(PHASE_DATA_BITMAP);
     bool data_bitmap_ok = check_data_bitmap();
+    begin_phase(PHASE_DUPLICATES);
     bool duplicates_ok = check_duplicates();
+    begin_phase(PHASE_BAD_BLOCKS);
     bool bad_blocks_ok = check_bad_blocks();
+    end_phase();
 
     
     print_fsck_results();
 
-    
-    if (!superblock_ok || !inode_bitmap_ok || !data_bitmap_ok || !duplicates_ok || !bad_blocks_ok) {
-                fix_errors();
+    int found[] = { fs->superblock_errors, fs->inode_bitmap_errors, fs->data_bitmap_errors,
+                    fs->duplicate_block_errors, fs->bad_block_errors };
+    memcpy(fs->errors_found, found, sizeof(found));
+    int outcome = IMAGE_CONSISTENT;
+    bool consistent = superblock_ok && inode_bitmap_ok && data_bitmap_ok && duplicates_ok && bad_blocks_ok;
+
+    if (!consistent && check_only) {
+        say("\nFile system left unchanged (-n).\n");
+        outcome = IMAGE_INCONSISTENT;
+    } else if (!consistent) {
+        begin_phase(PHASE_FIX);
+        fix_errors();
+        end_phase();
         
         //Recheck
-        superblock_errors = 0;
-        inode_bitmap_errors = 0;
-        data_bitmap_errors = 0;
-        duplicate_block_errors = 0;
-        bad_block_errors = 0;
+        fs->report_pass = 1;
+        fs->superblock_errors = 0;
+        fs->inode_bitmap_errors = 0;
+        fs->data_bitmap_errors = 0;
+        fs->duplicate_block_errors = 0;
+        fs->bad_block_errors = 0;
         
+        begin_phase(PHASE_WALK);
+        if (!scan_block_references()) {
+            notice("Out of memory walking block references\n");
+            close_fs_image();
+            return IMAGE_FAILED;
+        }
+        begin_phase(PHASE_SUPERBLOCK);
         check_superblock();
+        begin_phase(PHASE_INODE_BITMAP);
         check_inode_bitmap();
+        begin_phase(PHASE_DATA_BITMAP);
         check_data_bitmap();
+        begin_phase(PHASE_DUPLICATES);
         check_duplicates();
+        begin_phase(PHASE_BAD_BLOCKS);
         check_bad_blocks();
+        end_phase();
         
-        printf("\nRechecking after fixes...\n");
+        say("\nRechecking after fixes...\n");
         print_fsck_results();
+
+        int left = fs->superblock_errors + fs->inode_bitmap_errors + fs->data_bitmap_errors +
+                   fs->duplicate_block_errors + fs->bad_block_errors;
+        outcome = left == 0 ? IMAGE_REPAIRED : IMAGE_INCONSISTENT;
     }
 
-    
+    finish_report();
     close_fs_image();
-    return EXIT_SUCCESS;
+    return outcome;
 }
 
-// File image read+write
-bool open_fs_image() {
-    fs_fd = open(fs_image_path, O_RDWR);
-    return (fs_fd != -1);
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-//file image close
-void close_fs_image() {
-    if (fs_fd != -1) {
-        close(fs_fd);
-        fs_fd = -1;
+// The *.img files of a directory, sorted so runs list them the same way
+bool list_images(const char *dir, batch_t *b) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return false;
+    }
+    size_t cap = 0;
+    bool ok = true;
+    struct dirent *entry;
+    while (ok && (entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len <= 4 || strcmp(entry->d_name + len - 4, ".img") != 0) {
+            continue;
+        }
+        char *path = malloc(strlen(dir) + len + 2);
+        struct stat st;
+        if (path == NULL) {
+            ok = false;
+            break;
+        }
+        sprintf(path, "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+            free(path);
+            continue;
+        }
+        if (b->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(b->paths, cap * sizeof(char *));
+            if (grown == NULL) {
+                free(path);
+                ok = false;
+                break;
+            }
+            b->paths = grown;
+        }
+        b->paths[b->count++] = path;
     }
+    closedir(d);
+    qsort(b->paths, b->count, sizeof(char *), compare_paths);
+    return ok;
 }
 
+// Batch worker: takes the next image until none are left. A worker holds one
+// image at a time and frees all of it before taking the next, so its memory is
+// bounded by the largest image rather than growing with the batch.
+void *batch_worker(void *arg) {
+    batch_t *b = arg;
+    fsck_image_t image;
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        size_t k = b->next < b->count ? b->next++ : b->count;
+        pthread_mutex_unlock(&b->lock);
+        if (k == b->count) {
+            return NULL;
+        }
 
-bool read_block(int block_num, void *buffer) {
-    if (fs_fd == -1 || block_num < 0 || block_num >= TOTAL_BLOCKS) {
-        return false;
+        init_image(&image, b->paths[k], FORMAT_NONE, 1);
+        fs = &image;
+        int outcome = check_image();
+        int found = 0;
+        for (int c = 0; c < 5; c++) {
+            found += image.errors_found[c];
+        }
+        int left = image.superblock_errors + image.inode_bitmap_errors + image.data_bitmap_errors +
+                   image.duplicate_block_errors + image.bad_block_errors;
+
+        pthread_mutex_lock(&b->lock);
+        b->results[outcome]++;
+        for (int c = 0; c < 5; c++) {
+            b->errors[c] += image.errors_found[c];
+        }
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            b->phase_wall_ns[p] += image.phase_wall_ns[p];
+        }
+        b->bytes_read += image.bytes_read;
+        switch (outcome) {
+        case IMAGE_CONSISTENT:
+            printf("%s: consistent\n", image.path);
+            break;
+        case IMAGE_REPAIRED:
+            printf("%s: %d errors, repaired\n", image.path, found);
+            break;
+        case IMAGE_INCONSISTENT:
+            if (check_only) {
+                printf("%s: %d errors\n", image.path, found);
+            } else {
+                printf("%s: %d errors, %d left after repair\n", image.path, found, left);
+            }
+            break;
+        default:
+            printf("%s: could not be checked\n", image.path);
+            break;
+        }
+        pthread_mutex_unlock(&b->lock);
     }
+}
 
-    // Seek to the block
-    off_t offset = (off_t)block_num * BLOCK_SIZE;
-    if (lseek(fs_fd, offset, SEEK_SET) == -1) {
-        return false;
+// --batch: checks every *.img of dir with -j images at a time, each walked on
+// one thread, and prints one line per image and a summary. The exit status is
+// 0 only if every image ended up consistent, 4 if errors were left in any.
+int run_batch(const char *dir) {
+    static const char *category_names[] = { "superblock", "inode bitmap", "data bitmap", "duplicates", "bad blocks" };
+    static const char *phase_names[PHASE_COUNT] = {
+        "load", "walk", "superblock", "inode_bitmap", "data_bitmap", "duplicates", "bad_blocks", "fix"
+    };
+
+    batch_t b;
+    memset(&b, 0, sizeof(b));
+    pthread_mutex_init(&b.lock, NULL);
+    if (!list_images(dir, &b)) {
+        printf("Cannot list images in %s: %s\n", dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int workers = num_threads < (int)b.count ? num_threads : (int)b.count;
+    pthread_t tids[MAX_THREADS];
+    bool started[MAX_THREADS] = { false };
+    for (int t = 1; t < workers; t++) {
+        started[t] = (pthread_create(&tids[t], NULL, batch_worker, &b) == 0);
     }
+    batch_worker(&b);
+    for (int t = 1; t < workers; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = elapsed_ns(&start, &end) / 1e9;
+
+    printf("\nBatch Summary:\n");
+    printf("--------------\n");
+    printf("Images checked: %zu in %.3f s (%.1f images/s, %d at once)\n", b.count, seconds,
+           seconds > 0 ? b.count / seconds : 0.0, workers > 0 ? workers : 1);
+    printf("Consistent: %zu\n", b.results[IMAGE_CONSISTENT]);
+    printf("Repaired: %zu\n", b.results[IMAGE_REPAIRED]);
+    printf("%s: %zu\n", check_only ? "Inconsistent" : "Inconsistent after repair", b.results[IMAGE_INCONSISTENT]);
+    printf("Could not be checked: %zu\n", b.results[IMAGE_FAILED]);
+    printf("Errors found:");
+    for (int c = 0; c < 5; c++) {
+        printf("%s %s %llu", c ? "," : "", category_names[c], (unsigned long long)b.errors[c]);
+    }
+    printf("\nTime in phases, all images:");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        printf("%s %s %.1f ms", p ? "," : "", phase_names[p], b.phase_wall_ns[p] / 1e6);
+    }
+    printf("\nImage bytes read: %llu\n", (unsigned long long)b.bytes_read);
 
-    // Read the block
-    ssize_t bytes_read = read(fs_fd, buffer, BLOCK_SIZE);
-    return (bytes_read == BLOCK_SIZE);
+    int status = EXIT_SUCCESS;
+    if (b.results[IMAGE_FAILED] > 0) {
+        status = EXIT_FAILURE;
+    } else if (b.results[IMAGE_INCONSISTENT] > 0) {
+        status = EXIT_UNCORRECTED;
+    }
+    for (size_t k = 0; k < b.count; k++) {
+        free(b.paths[k]);
+    }
+    free(b.paths);
+    pthread_mutex_destroy(&b.lock);
+    return status;
 }
 
-bool write_block(int block_num, void *buffer) {
-    if (fs_fd == -1 || block_num < 0 || block_num >= TOTAL_BLOCKS) {
+// File image read+write, mapped when possible. With -n it is opened read-only
+// and always read with pread, metadata in one read and indirect blocks in
+// block order (see prefetch_indirect_blocks()).
+bool open_fs_image() {
+    fs->fd = open(fs->path, check_only ? O_RDONLY : O_RDWR);
+    if (fs->fd == -1) {
         return false;
     }
 
-    // Seek to the block
-    off_t offset = (off_t)block_num * BLOCK_SIZE;
-    if (lseek(fs_fd, offset, SEEK_SET) == -1) {
-        return false;
+    // Size in blocks, SEEK_END also works for block devices
+    off_t size = lseek(fs->fd, 0, SEEK_END);
+    if (size < 0) {
+        size = 0;
+    }
+    fs->image_blocks = (size / BLOCK_SIZE > UINT32_MAX) ? UINT32_MAX : (uint32_t)(size / BLOCK_SIZE);
+
+    // Block devices and empty images fall back to lseek+read/write. The mapping is
+    // private so fixes stay in memory until commit_fs_image() journals them.
+    struct stat st;
+    if (use_mmap && !check_only && fstat(fs->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= BLOCK_SIZE) {
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fs->fd, 0);
+        if (map != MAP_FAILED) {
+            fs->map = map;
+            fs->map_size = st.st_size;
+        }
     }
+    return true;
+}
 
-    // Write the block
-    ssize_t bytes_written = write(fs_fd, buffer, BLOCK_SIZE);
-    return (bytes_written == BLOCK_SIZE);
+//file image close
+void close_fs_image() {
+    free(fs->used_extents);
+    fs->used_extents = NULL;
+    fs->used_count = fs->used_cap = 0;
+    free(fs->dup_extents);
+    fs->dup_extents = NULL;
+    fs->dup_count = 0;
+    free(fs->valid_inodes);
+    fs->valid_inodes = NULL;
+    free(fs->outlier_inodes);
+    fs->outlier_inodes = NULL;
+    free_inode_columns();
+    free(fs->dup_owners);
+    fs->dup_owners = NULL;
+    fs->dup_owner_count = 0;
+    free(fs->bad_block_findings);
+    fs->bad_block_findings = NULL;
+    fs->bad_block_finding_count = 0;
+    free(fs->meta_cache);
+    free(fs->meta_read_ok);
+    free(fs->dirty_blocks);
+    free_staged();
+    fs->meta_read_ok = NULL;
+    fs->dirty_blocks = NULL;
+    fs->meta_cache = NULL;
+
+    if (fs->map != NULL) {
+        munmap(fs->map, fs->map_size);
+        fs->map = NULL;
+        fs->map_size = 0;
+    }
+    if (fs->fd != -1) {
+        close(fs->fd);
+        fs->fd = -1;
+    }
 }
 
 
+bool read_block(int block_num, void *buffer) {
+    if (fs->fd == -1 || block_num < 0 || (uint32_t)block_num >= fs->image_blocks) {
+        return false;
+    }
 
-//Checks if a bit is set in the bitmap
+    if (fs->map != NULL) {
+        const void *src = get_block(block_num, NULL);
+        if (src == NULL) {
+            return false;
+        }
+        memcpy(buffer, src, BLOCK_SIZE);
+        return true;
+    }
 
-bool is_used_bit(uint8_t *bitmap, int bit_index) {
-    int byte_index = bit_index / 8;
-    int bit_offset = bit_index % 8;
-    return (bitmap[byte_index] & (1 << bit_offset)) != 0;
-}
+    // Fixes not committed yet
+    if (fs->dirty_blocks != NULL && is_block_marked(fs->dirty_blocks, block_num)) {
+        memcpy(buffer, dirty_block_data(block_num), BLOCK_SIZE);
+        return true;
+    }
 
+    // Positioned read, safe to share the descriptor between walk threads
+    off_t offset = (off_t)block_num * BLOCK_SIZE;
+    ssize_t got = pread(fs->fd, buffer, BLOCK_SIZE, offset);
+    if (got > 0) {
+        count_read(got);
+    }
+    return (got == BLOCK_SIZE);
+}
 
-//Sets a bit in the bitmap
+bool write_block(int block_num, void *buffer) {
+    if (fs->fd == -1 || block_num < 0 || (uint32_t)block_num >= fs->image_blocks) {
+        return false;
+    }
 
-void set_bit(uint8_t *bitmap, int bit_index) {
-    int byte_index = bit_index / 8;
-    int bit_offset = bit_index % 8;
-    bitmap[byte_index] |= (1 << bit_offset);
+    // Every write is staged and reaches the image at commit_fs_image()
+    uint8_t *dst;
+    if (fs->map != NULL) {
+        if ((size_t)(block_num + 1) * BLOCK_SIZE > fs->map_size) {
+            return false;
+        }
+        dst = fs->map + (size_t)block_num * BLOCK_SIZE;
+    } else if ((uint32_t)block_num < fs->data_block_start) {
+        dst = fs->meta_cache + (size_t)block_num * BLOCK_SIZE;
+    } else {
+        dst = stage_block(block_num);
+        if (dst == NULL) {
+            return false;
+        }
+    }
+    memcpy(dst, buffer, BLOCK_SIZE);
+    mark_block_dirty(block_num);
+    return true;
 }
 
 
-//Clears a bit in the bitmap
-
-void clear_bit(uint8_t *bitmap, int bit_index) {
-    int byte_index = bit_index / 8;
-    int bit_offset = bit_index % 8;
-    bitmap[byte_index] &= ~(1 << bit_offset);
+// Returns a block in place when mapped, otherwise reads it into scratch
+const void *get_block(int block_num, void *scratch) {
+    if (block_num < 0 || (uint32_t)block_num >= fs->image_blocks) {
+        return NULL;
+    }
+    if (fs->map != NULL) {
+        if ((size_t)(block_num + 1) * BLOCK_SIZE > fs->map_size) {
+            return NULL;
+        }
+        count_read(BLOCK_SIZE);
+        return fs->map + (size_t)block_num * BLOCK_SIZE;
+    }
+    return read_block(block_num, scratch) ? scratch : NULL;
 }
 
 
-bool is_valid_inode(inode_t *inode) {
-    return ((*inode).links_count > 0 && (*inode).dtime == 0);
+// Layout mkfs would give an image of total_blocks blocks holding inode_count inodes
+void default_layout(superblock_t *sb, uint32_t total_blocks, uint32_t inode_count) {
+    sb->magic = VSFS_MAGIC;
+    sb->block_size = BLOCK_SIZE;
+    sb->total_blocks = total_blocks;
+    sb->inode_size = INODE_SIZE;
+    sb->inode_count = inode_count;
+    sb->inode_bitmap_block = SUPERBLOCK_BLOCK_NUM + 1;
+    sb->data_bitmap_block = sb->inode_bitmap_block + DIV_ROUND_UP(inode_count, BITS_PER_BLOCK);
+    sb->inode_table_block = sb->data_bitmap_block + DIV_ROUND_UP(total_blocks, BITS_PER_BLOCK);
+    sb->data_block_start = sb->inode_table_block + DIV_ROUND_UP(inode_count, INODES_PER_BLOCK);
 }
 
-
-bool check_superblock() {
-    
-    if (!read_block(SUPERBLOCK_BLOCK_NUM, &superblock)) {
-        printf("Error reading superblock\n");
-        superblock_errors++;
+// Checks the superblock layout is ordered and every region is big enough
+bool layout_fits(const superblock_t *sb, uint32_t total_blocks) {
+    if (sb->inode_count == 0) {
         return false;
     }
-
-    bool is_valid = true;
-
-    
-    if (superblock.magic != VSFS_MAGIC) {
-        printf("Error: Invalid superblock magic number (0x%04X, expected 0x%04X)\n",
-               superblock.magic, VSFS_MAGIC);
-        is_valid = false;
-        superblock_errors++;
+    if (!(SUPERBLOCK_BLOCK_NUM < sb->inode_bitmap_block &&
+          sb->inode_bitmap_block < sb->data_bitmap_block &&
+          sb->data_bitmap_block < sb->inode_table_block &&
+          sb->inode_table_block < sb->data_block_start &&
+          sb->data_block_start < total_blocks)) {
+        return false;
     }
-
-    // Check block size
-    if (superblock.block_size != BLOCK_SIZE) {
-        printf("Error: Invalid block size (%u, expected %u)\n",
-               superblock.block_size, BLOCK_SIZE);
-        is_valid = false;
-        superblock_errors++;
+    if ((uint64_t)(sb->data_bitmap_block - sb->inode_bitmap_block) * BITS_PER_BLOCK < sb->inode_count) {
+        return false;
     }
-
-    // Check total blocks
-    if (superblock.total_blocks != TOTAL_BLOCKS) {
-        printf("Error: Invalid total blocks (%u, expected %u)\n",
-               superblock.total_blocks, TOTAL_BLOCKS);
-        is_valid = false;
-        superblock_errors++;
+    if ((uint64_t)(sb->inode_table_block - sb->data_bitmap_block) * BITS_PER_BLOCK <
+        total_blocks - sb->data_block_start) {
+        return false;
     }
+    return (uint64_t)(sb->data_block_start - sb->inode_table_block) * INODES_PER_BLOCK >= sb->inode_count;
+}
 
-    // Check inode bitmap block number
-    if (superblock.inode_bitmap_block != INODE_BITMAP_BLOCK_NUM) {
-        printf("Error: Invalid inode bitmap block number (%u, expected %u)\n",
-               superblock.inode_bitmap_block, INODE_BITMAP_BLOCK_NUM);
-        is_valid = false;
-        superblock_errors++;
+// Picks the geometry to check with: the superblock layout when it is consistent
+// with the image size, otherwise the default layout for the image (sb may be NULL)
+void derive_geometry(const superblock_t *sb) {
+    bool sb_ok = (sb != NULL);
+    uint32_t total = fs->image_blocks;
+    if (total == 0 && sb_ok) {
+        total = sb->total_blocks;
     }
 
-    // Check data bitmap block number
-    if (superblock.data_bitmap_block != DATA_BITMAP_BLOCK_NUM) {
-        printf("Error: Invalid data bitmap block number (%u, expected %u)\n",
-               superblock.data_bitmap_block, DATA_BITMAP_BLOCK_NUM);
-        is_valid = false;
-        superblock_errors++;
+    superblock_t expected;
+    if (sb_ok && layout_fits(sb, total)) {
+        default_layout(&expected, total, sb->inode_count);
+        expected.inode_bitmap_block = sb->inode_bitmap_block;
+        expected.data_bitmap_block = sb->data_bitmap_block;
+        expected.inode_table_block = sb->inode_table_block;
+        expected.data_block_start = sb->data_block_start;
+    } else if (sb_ok && sb->inode_count > 0 &&
+               sb->inode_count <= (uint64_t)total * INODES_PER_BLOCK / 2) {
+        // Layout is damaged but the inode count is plausible
+        default_layout(&expected, total, sb->inode_count);
+    } else {
+        // Same inode density as the reference image, rounded up to whole table blocks
+        uint64_t count = (uint64_t)total * INODE_COUNT / TOTAL_BLOCKS;
+        count = DIV_ROUND_UP(count, INODES_PER_BLOCK) * INODES_PER_BLOCK;
+        default_layout(&expected, total, count > 0 ? (uint32_t)count : INODES_PER_BLOCK);
     }
 
-    // Check inode table start block number
-    if (superblock.inode_table_block != INODE_TABLE_START_BLOCK) {
-        printf("Error: Invalid inode table start block number (%u, expected %u)\n",
-               superblock.inode_table_block, INODE_TABLE_START_BLOCK);
-        is_valid = false;
-        superblock_errors++;
-    }
+    fs->total_blocks = expected.total_blocks;
+    fs->inode_count = expected.inode_count;
+    fs->inode_bitmap_block = expected.inode_bitmap_block;
+    fs->data_bitmap_block = expected.data_bitmap_block;
+    fs->inode_table_block = expected.inode_table_block;
+    fs->data_block_start = expected.data_block_start;
+}
 
-    // Check data block start number
-    if (superblock.data_block_start != DATA_BLOCK_START) {
-        printf("Error: Invalid data block start number (%u, expected %u)\n",
-               superblock.data_block_start, DATA_BLOCK_START);
-        is_valid = false;
-        superblock_errors++;
+// Points superblock, bitmaps and inode table at the mapping, or reads them into meta_cache.
+// False only when out of memory, blocks that cannot be read are left false in meta_read_ok.
+bool load_metadata() {
+    // Superblock first, it decides how big the metadata region is
+    uint8_t sb_block[BLOCK_SIZE];
+    derive_geometry(get_block(SUPERBLOCK_BLOCK_NUM, sb_block));
+
+    uint32_t meta_blocks = fs->data_block_start;
+    fs->meta_read_ok = calloc(meta_blocks, sizeof(bool));
+    fs->dirty_map_words = DIV_ROUND_UP((size_t)(fs->total_blocks > fs->image_blocks ? fs->total_blocks : fs->image_blocks), 64);
+    fs->dirty_blocks = calloc(fs->dirty_map_words, sizeof(uint64_t));
+    if (fs->meta_read_ok == NULL || fs->dirty_blocks == NULL) {
+        return false;
     }
 
-    // Check inode size
-    if (superblock.inode_size != INODE_SIZE) {
-        printf("Error: Invalid inode size (%u, expected %u)\n",
-               superblock.inode_size, INODE_SIZE);
-        is_valid = false;
-        superblock_errors++;
+    // A mapping that does not cover the metadata region is dropped for the read/write path
+    if (fs->map != NULL && (size_t)meta_blocks * BLOCK_SIZE > fs->map_size) {
+        munmap(fs->map, fs->map_size);
+        fs->map = NULL;
+        fs->map_size = 0;
+    }
+    if (fs->map == NULL) {
+        fs->meta_cache = malloc((size_t)meta_blocks * BLOCK_SIZE);
+        if (fs->meta_cache == NULL) {
+            return false;
+        }
+    }
+    uint8_t *meta = fs->map != NULL ? fs->map : fs->meta_cache;
+    uint32_t read_blocks = 0;
+    if (fs->map != NULL) {
+        count_read((uint64_t)meta_blocks * BLOCK_SIZE);
+    } else {
+        // Superblock through inode table in one sequential read, block by block
+        // only from the first block that read fails or stops short at
+        posix_fadvise(fs->fd, 0, (off_t)meta_blocks * BLOCK_SIZE, POSIX_FADV_SEQUENTIAL);
+        read_blocks = pread_blocks(fs->meta_cache, 0, meta_blocks);
     }
 
-    // Check inode count
-    if (superblock.inode_count != INODE_COUNT) {
-        printf("Error: Invalid inode count (%u, expected %u)\n",
-               superblock.inode_count, INODE_COUNT);
-        is_valid = false;
-        superblock_errors++;
+    for (uint32_t b = 0; b < meta_blocks; b++) {
+        fs->meta_read_ok[b] = true;
+        if (fs->map == NULL && b >= read_blocks && !read_block(b, fs->meta_cache + (size_t)b * BLOCK_SIZE)) {
+            if (b >= fs->inode_table_block) {
+                notice("Error reading inode table block %u\n", b);
+            }
+            memset(fs->meta_cache + (size_t)b * BLOCK_SIZE, 0, BLOCK_SIZE); // Unreadable inodes are treated as free
+            fs->meta_read_ok[b] = false;
+        }
     }
 
-    if (is_valid) {
-        printf("Superblock check: PASSED\n");
-    } else {
-        printf("Superblock check: FAILED\n");
+    fs->superblock = (superblock_t *)(meta + (size_t)SUPERBLOCK_BLOCK_NUM * BLOCK_SIZE);
+    fs->inode_bitmap = meta + (size_t)fs->inode_bitmap_block * BLOCK_SIZE;
+    fs->data_bitmap = meta + (size_t)fs->data_bitmap_block * BLOCK_SIZE;
+    fs->inode_table = (inode_t *)(meta + (size_t)fs->inode_table_block * BLOCK_SIZE);
+    return true;
+}
+
+// True if every metadata block in [first, end) could be read
+bool region_read_ok(uint32_t first, uint32_t end) {
+    for (uint32_t b = first; b < end; b++) {
+        if (!fs->meta_read_ok[b]) {
+            return false;
+        }
     }
+    return true;
+}
 
-    return is_valid;
+// The valid inode bitmaps. Block references are extents built by each walk.
+bool alloc_block_tracking() {
+    fs->block_map_words = DIV_ROUND_UP((size_t)(fs->total_blocks - fs->data_block_start), 64);
+    fs->inode_map_words = DIV_ROUND_UP((size_t)fs->inode_count, 64);
+    fs->valid_inodes = calloc(fs->inode_map_words, sizeof(uint64_t));
+    fs->outlier_inodes = calloc(fs->inode_map_words, sizeof(uint64_t));
+    return fs->valid_inodes != NULL && fs->outlier_inodes != NULL;
 }
 
+// Adds a block to the dirty set written back by commit_fs_image()
+void mark_block_dirty(int block_num) {
+    if (block_num >= 0 && (size_t)block_num < fs->dirty_map_words * 64) {
+        mark_block(fs->dirty_blocks, block_num);
+    }
+}
 
+// Marks a run of metadata blocks for write back
+void mark_range_dirty(uint32_t first, uint32_t end) {
+    for (uint32_t b = first; b < end; b++) {
+        mark_block_dirty(b);
+    }
+}
 
+// Marks the table block holding an inode for write back
+void mark_inode_dirty(int inode_num) {
+    mark_block_dirty(fs->inode_table_block + inode_num / INODES_PER_BLOCK);
+}
 
+// Buffer holding the staged contents of a data block, added on first use
+uint8_t *stage_block(uint32_t block_num) {
+    if (fs->staged_count * 2 >= fs->staged_cap) {
+        size_t cap = fs->staged_cap ? fs->staged_cap * 2 : 64;
+        staged_block_t *grown = calloc(cap, sizeof(staged_block_t));
+        if (grown == NULL) {
+            return NULL;
+        }
+        for (size_t k = 0; k < fs->staged_cap; k++) {
+            if (fs->staged[k].block != 0) {
+                size_t h = (fs->staged[k].block * 2654435761u) & (cap - 1);
+                while (grown[h].block != 0) {
+                    h = (h + 1) & (cap - 1);
+                }
+                grown[h] = fs->staged[k];
+            }
+        }
+        free(fs->staged);
+        fs->staged = grown;
+        fs->staged_cap = cap;
+    }
 
-bool check_inode_bitmap() {
-    printf("Checking inode bitmap...\n");
-    
-    inode_bitmap_errors = 0;
-    int type1_errors = 0;  // Invalid inodes marked used
-    int type2_errors = 0;  // Valid inodes not marked used
-    
-    // Read the inode bitmap from disk
-    if (!read_block(INODE_BITMAP_BLOCK_NUM, inode_bitmap)) {
-        fprintf(stderr, "Error reading inode bitmap\n");
-        inode_bitmap_errors++;
-        return false;
+    size_t h = (block_num * 2654435761u) & (fs->staged_cap - 1);
+    while (fs->staged[h].block != 0 && fs->staged[h].block != block_num) {
+        h = (h + 1) & (fs->staged_cap - 1);
     }
-    
-    // Check each inode
-    for (int i = 0; i < INODE_COUNT; i++) {
-        inode_t inode;
-        int block_num = INODE_TABLE_START_BLOCK + (i * INODE_SIZE) / BLOCK_SIZE;
-        int offset = (i * INODE_SIZE) % BLOCK_SIZE;
-        
-        uint8_t block[BLOCK_SIZE];
-        if (!read_block(block_num, block)) {
-            printf("Error reading inode table block %d\n", block_num);
-            inode_bitmap_errors++;
-            continue;
-        }
-        
-        memcpy(&inode, block + offset, sizeof(inode_t));
-        
-        // Determine if inode is valid
-        bool valid = is_valid_inode(&inode);
-        
-        // Type 1 error: Inode is marked as used but is invalid
-        if (is_used_bit(inode_bitmap, i) && !valid) {
-            printf("Error: Inode %d is marked as used but is invalid\n", i);
-            type1_errors++;
-        } 
-        // Type 2 error: Inode is valid but not marked as used
-        else if (!is_used_bit(inode_bitmap, i) && valid) {
-            printf("Error: Inode %d is valid but not marked as used\n", i);
-            type2_errors++;
+    if (fs->staged[h].block == 0) {
+        uint8_t *data = malloc(BLOCK_SIZE);
+        if (data == NULL) {
+            return NULL;
         }
+        fs->staged[h].block = block_num;
+        fs->staged[h].data = data;
+        fs->staged_count++;
     }
-    
-    
-    inode_bitmap_errors = type1_errors + type2_errors;
-    
-    
-    if (inode_bitmap_errors > 0) {
-        printf("Inode bitmap errors summary: %d errors\n", inode_bitmap_errors);
-        printf("  - Invalid inodes marked as used: %d\n", type1_errors);
-        printf("  - Valid inodes not marked as used: %d\n", type2_errors);
+    return fs->staged[h].data;
+}
+
+const uint8_t *find_staged(uint32_t block_num) {
+    if (fs->staged_cap == 0) {
+        return NULL;
     }
-    
-    return (inode_bitmap_errors == 0);
+    size_t h = (block_num * 2654435761u) & (fs->staged_cap - 1);
+    while (fs->staged[h].block != 0) {
+        if (fs->staged[h].block == block_num) {
+            return fs->staged[h].data;
+        }
+        h = (h + 1) & (fs->staged_cap - 1);
+    }
+    return NULL;
 }
- 
-//Checks data bitmap consistency
 
-bool check_data_bitmap() {
-    
-    if (!read_block(DATA_BITMAP_BLOCK_NUM, data_bitmap)) {
-        fprintf(stderr, "Error reading data bitmap\n");
-        data_bitmap_errors++;
-        return false;
+void free_staged() {
+    for (size_t k = 0; k < fs->staged_cap; k++) {
+        free(fs->staged[k].data);
     }
+    free(fs->staged);
+    fs->staged = NULL;
+    fs->staged_cap = 0;
+    fs->staged_count = 0;
+}
 
-    bool is_valid = true;
+// New contents of a dirty block: the private mapping, the metadata cache or the staged copy
+const void *dirty_block_data(uint32_t block_num) {
+    if (fs->map != NULL) {
+        return fs->map + (size_t)block_num * BLOCK_SIZE;
+    }
+    if (block_num < fs->data_block_start) {
+        return fs->meta_cache + (size_t)block_num * BLOCK_SIZE;
+    }
+    return find_staged(block_num);
+}
 
-    // Check that every block marked as used in the bitmap is actually used
-    for (uint32_t i = DATA_BLOCK_START; i < TOTAL_BLOCKS; i++) {
-        if (is_used_bit(data_bitmap, i - DATA_BLOCK_START)) {
-            if (!used_blocks[i]) {
-                printf("Error: Block %u is marked as used in bitmap but not actually used\n", i);
-                is_valid = false;
-                data_bitmap_errors++;
-            }
-        } else {
-            // Block is marked as free, but actually used
-            if (used_blocks[i]) {
-                printf("Error: Block %u is used but not marked in bitmap\n", i);
-                is_valid = false;
-                data_bitmap_errors++;
+// Reads or writes blocks (ascending block numbers) with one preadv/pwritev per
+// run of consecutive blocks, split at IOV_MAX
+bool transfer_blocks(int fd, const uint32_t *blocks, uint8_t *const *data, size_t count, bool write) {
+    struct iovec iov[1024];
+    for (size_t k = 0; k < count;) {
+        int run = 0;
+        do {
+            iov[run].iov_base = data[k + run];
+            iov[run].iov_len = BLOCK_SIZE;
+            run++;
+        } while (k + run < count && run < 1024 && blocks[k + run] == blocks[k] + (uint32_t)run);
+
+        off_t offset = (off_t)blocks[k] * BLOCK_SIZE;
+        ssize_t want = (ssize_t)run * BLOCK_SIZE;
+        ssize_t done = write ? pwritev(fd, iov, run, offset) : preadv(fd, iov, run, offset);
+        if (!write && done > 0) {
+            count_read(done);
+        }
+        if (done != want) {
+            // Short or failed transfer, finish block by block
+            for (int r = 0; r < run; r++) {
+                off_t at = offset + (off_t)r * BLOCK_SIZE;
+                ssize_t n = write ? pwrite(fd, data[k + r], BLOCK_SIZE, at) : pread(fd, data[k + r], BLOCK_SIZE, at);
+                if (n != BLOCK_SIZE) {
+                    notice("Error %s block %u\n", write ? "writing" : "reading", blocks[k + r]);
+                    return false;
+                }
             }
         }
+        k += run;
     }
+    return true;
+}
 
-    if (is_valid) {
-        printf("Data bitmap check: PASSED\n");
-    } else {
-        printf("Data bitmap check: FAILED\n");
+// Reads blocks [first, first + count) with as few preads as the kernel allows,
+// returns how many whole blocks were read before an error or the end of the image
+uint32_t pread_blocks(void *buffer, uint32_t first, uint32_t count) {
+    if (first >= fs->image_blocks) {
+        return 0;
     }
-
-    return is_valid;
+    if (count > fs->image_blocks - first) {
+        count = fs->image_blocks - first;
+    }
+    uint8_t *p = buffer;
+    size_t size = (size_t)count * BLOCK_SIZE;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fs->fd, p + done, size - done, (off_t)first * BLOCK_SIZE + done);
+        if (n <= 0) {
+            break;
+        }
+        count_read(n);
+        done += n;
+    }
+    return (uint32_t)(done / BLOCK_SIZE);
 }
 
-//Checks for duplicate block references
-bool check_duplicates() {
-    bool is_valid = true;
-    for (uint32_t i = DATA_BLOCK_START; i < TOTAL_BLOCKS; i++) {
-        if (duplicated_blocks[i]) {
-            printf("Error: Block %u is referenced by multiple inodes\n", i);
-            is_valid = false;
+bool pwrite_full(int fd, const void *buffer, size_t size, off_t offset) {
+    const uint8_t *p = buffer;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n <= 0) {
+            return false;
         }
+        p += n;
+        size -= n;
+        offset += n;
     }
+    return true;
+}
 
-    if (is_valid) {
-        printf("Duplicate blocks check: PASSED\n");
-    } else {
-        printf("Duplicate blocks check: FAILED\n");
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
     }
+    return hash;
+}
 
-    return is_valid;
+// Journal next to the image: <image>.journal
+char *journal_path() {
+    snprintf(fs->journal, sizeof(fs->journal), "%s.journal", fs->path);
+    return fs->journal;
 }
 
-void check_indirect_block(uint32_t block_num, int level, int inode_num) {
-    if (block_num < DATA_BLOCK_START || block_num >= TOTAL_BLOCKS) {
-        printf("Error: Inode %d has invalid level-%d indirect block %u\n",
-               inode_num, level, block_num);
-        bad_block_errors++;
-        return;
+// Commits every staged fix as one transaction: the undo/redo journal is
+// written and synced first, then the dirty blocks go to the image in block
+// order, consecutive blocks coalesced into one pwritev, followed by a single
+// fsync. A crash before the journal is synced leaves the image untouched, a
+// crash after it is finished from the journal on the next run.
+bool commit_fs_image() {
+    size_t count = 0;
+    for (size_t k = 0; k < fs->dirty_map_words; k++) {
+        count += __builtin_popcountll(fs->dirty_blocks[k]);
     }
-    uint32_t block_pointers[BLOCK_SIZE / sizeof(uint32_t)];
-    if (!read_block(block_num, block_pointers)) {
-        printf("Error: Could not read indirect block %u (level %d) for inode %d\n",
-               block_num, level, inode_num);
-        bad_block_errors++;
-        return;
+    if (count == 0) {
+        return true;
     }
-    int num_pointers = BLOCK_SIZE / sizeof(uint32_t);
-    for (int i = 0; i < num_pointers; i++) {
-        if (block_pointers[i] != 0) {
-            if (block_pointers[i] < DATA_BLOCK_START || block_pointers[i] >= TOTAL_BLOCKS) {
-                printf("Error: Inode %d has invalid block pointer %u in level-%d indirect block %u\n",
-                       inode_num, block_pointers[i], level, block_num);
-                bad_block_errors++;
-            } else {
-                used_blocks[block_pointers[i]] = true;
-                if (level > 1) {
-                    check_indirect_block(block_pointers[i], level - 1, inode_num);
-                }
+
+    uint32_t *blocks = malloc(count * sizeof(uint32_t));
+    uint8_t **undo = malloc(count * sizeof(uint8_t *));
+    uint8_t **redo = malloc(count * sizeof(uint8_t *));
+    uint8_t *undo_data = malloc(count * BLOCK_SIZE);
+    bool ok = blocks != NULL && undo != NULL && redo != NULL && undo_data != NULL;
+
+    // Sorted by construction, blocks past the end of the image cannot be written
+    size_t n = 0;
+    for (size_t k = 0; ok && k < fs->dirty_map_words; k++) {
+        for (uint64_t word = fs->dirty_blocks[k]; word != 0; word &= word - 1) {
+            uint32_t b = k * 64 + __builtin_ctzll(word);
+            if (b >= fs->image_blocks) {
+                notice("Error writing block %u\n", b);
+                continue;
             }
+            blocks[n] = b;
+            undo[n] = undo_data + n * BLOCK_SIZE;
+            redo[n] = (uint8_t *)dirty_block_data(b);
+            n++;
         }
     }
-}
-//Checks for blocks outside valid range
-bool check_bad_blocks() {
-    bad_block_errors = 0;
-    
-    //reset the used blocks
-    memset(used_blocks, 0, sizeof(used_blocks));
-    
-    // Check all inodes for bad block references
-    for (int i = 0; i < INODE_COUNT; i++) {
-        inode_t inode;
-        int block_num = INODE_TABLE_START_BLOCK + (i * INODE_SIZE) / BLOCK_SIZE;
-        int offset = (i * INODE_SIZE) % BLOCK_SIZE;
-        
-        uint8_t block[BLOCK_SIZE];
-        if (!read_block(block_num, block)) {
-            printf("Error reading inode table block %d\n", block_num);
-            continue;
+
+    // Old contents from the image itself, fixes have not touched it yet
+    ok = ok && transfer_blocks(fs->fd, blocks, undo, n, false);
+    ok = ok && write_journal(journal_path(), blocks, undo, redo, n);
+    if (!ok) {
+        notice("Error writing journal %s, image left unchanged\n", journal_path());
+    }
+
+    if (ok) {
+        ok = transfer_blocks(fs->fd, blocks, redo, n, true);
+        if (fsync(fs->fd) != 0) {
+            notice("fsync: %s\n", strerror(errno));
+            ok = false;
         }
-        
-        memcpy(&inode, block + offset, sizeof(inode_t));
-        
-        
-        if (!is_valid_inode(&inode)) {
+    }
+    if (ok) {
+        // Not synced: if this is lost the next run replays the same blocks again
+        int jfd = open(journal_path(), O_WRONLY);
+        uint32_t state = JOURNAL_APPLIED;
+        if (jfd != -1) {
+            pwrite_full(jfd, &state, sizeof(state), offsetof(journal_header_t, state));
+            close(jfd);
+        }
+        say("Committed %zu blocks (journal %s)\n", n, journal_path());
+        memset(fs->dirty_blocks, 0, fs->dirty_map_words * sizeof(uint64_t));
+        free_staged();
+    }
+
+    free(blocks);
+    free(undo);
+    free(redo);
+    free(undo_data);
+    return ok;
+}
+
+// Writes and syncs the journal of one transaction
+bool write_journal(const char *path, const uint32_t *blocks, uint8_t *const *undo, uint8_t *const *redo,
+                   size_t count) {
+    size_t table_size = DIV_ROUND_UP(count * sizeof(uint32_t), BLOCK_SIZE) * BLOCK_SIZE;
+    uint8_t *header_block = calloc(1, BLOCK_SIZE);
+    uint8_t *table = calloc(1, table_size);
+    if (header_block == NULL || table == NULL) {
+        free(header_block);
+        free(table);
+        return false;
+    }
+    memcpy(table, blocks, count * sizeof(uint32_t));
+
+    journal_header_t *header = (journal_header_t *)header_block;
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->state = JOURNAL_PENDING;
+    header->block_size = BLOCK_SIZE;
+    header->count = count;
+    header->image_blocks = fs->image_blocks;
+    uint64_t hash = fnv1a(0xcbf29ce484222325ULL, table, table_size);
+    for (size_t k = 0; k < count; k++) {
+        hash = fnv1a(hash, undo[k], BLOCK_SIZE);
+    }
+    for (size_t k = 0; k < count; k++) {
+        hash = fnv1a(hash, redo[k], BLOCK_SIZE);
+    }
+    header->checksum = hash;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd != -1;
+    off_t offset = 0;
+    ok = ok && pwrite_full(fd, header_block, BLOCK_SIZE, offset);
+    offset += BLOCK_SIZE;
+    ok = ok && pwrite_full(fd, table, table_size, offset);
+    offset += table_size;
+    for (size_t k = 0; ok && k < count; k++, offset += BLOCK_SIZE) {
+        ok = pwrite_full(fd, undo[k], BLOCK_SIZE, offset);
+    }
+    for (size_t k = 0; ok && k < count; k++, offset += BLOCK_SIZE) {
+        ok = pwrite_full(fd, redo[k], BLOCK_SIZE, offset);
+    }
+    ok = ok && fsync(fd) == 0;
+    if (fd != -1) {
+        close(fd);
+    }
+
+    free(header_block);
+    free(table);
+    return ok;
+}
+
+// Loads a journal and checks it is complete, false if it is missing or torn.
+// blocks, undo and redo are allocated here and belong to the caller.
+bool read_journal(const char *path, journal_header_t *header, uint32_t **blocks, uint8_t **undo,
+                  uint8_t **redo) {
+    *blocks = NULL;
+    *undo = *redo = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    bool ok = pread(fd, header, sizeof(*header), 0) == sizeof(*header) &&
+              memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) == 0 &&
+              header->block_size == BLOCK_SIZE && header->image_blocks == fs->image_blocks;
+    size_t count = ok ? header->count : 0;
+    size_t table_size = DIV_ROUND_UP(count * sizeof(uint32_t), BLOCK_SIZE) * BLOCK_SIZE;
+    uint8_t *table = ok ? malloc(table_size + 1) : NULL;
+    *undo = ok ? malloc(count * BLOCK_SIZE + 1) : NULL;
+    *redo = ok ? malloc(count * BLOCK_SIZE + 1) : NULL;
+    ok = ok && table != NULL && *undo != NULL && *redo != NULL;
+
+    off_t offset = BLOCK_SIZE;
+    ok = ok && pread(fd, table, table_size, offset) == (ssize_t)table_size;
+    offset += table_size;
+    ok = ok && pread(fd, *undo, count * BLOCK_SIZE, offset) == (ssize_t)(count * BLOCK_SIZE);
+    offset += count * BLOCK_SIZE;
+    ok = ok && pread(fd, *redo, count * BLOCK_SIZE, offset) == (ssize_t)(count * BLOCK_SIZE);
+    close(fd);
+
+    if (ok) {
+        uint64_t hash = fnv1a(0xcbf29ce484222325ULL, table, table_size);
+        hash = fnv1a(hash, *undo, count * BLOCK_SIZE);
+        hash = fnv1a(hash, *redo, count * BLOCK_SIZE);
+        ok = hash == header->checksum;
+    }
+    for (size_t k = 0; ok && k < count; k++) {
+        ok = ((uint32_t *)table)[k] < fs->image_blocks && (k == 0 || ((uint32_t *)table)[k] > ((uint32_t *)table)[k - 1]);
+    }
+    if (!ok) {
+        free(table);
+        free(*undo);
+        free(*redo);
+        *undo = *redo = NULL;
+        return false;
+    }
+    *blocks = (uint32_t *)table;
+    return true;
+}
+
+// Writes one side of a journal to the image, contents laid out block after block
+bool apply_journal_side(const uint32_t *blocks, uint8_t *contents, size_t count) {
+    uint8_t **data = malloc(count * sizeof(uint8_t *) + 1);
+    if (data == NULL) {
+        return false;
+    }
+    for (size_t k = 0; k < count; k++) {
+        data[k] = contents + k * BLOCK_SIZE;
+    }
+    bool ok = transfer_blocks(fs->fd, blocks, data, count, true) && fsync(fs->fd) == 0;
+    free(data);
+    return ok;
+}
+
+// A journal still pending means the last repair may have been cut short
+// while writing the image, its new contents are written again
+bool recover_journal() {
+    journal_header_t header;
+    uint32_t *blocks;
+    uint8_t *undo, *redo;
+    if (access(journal_path(), F_OK) != 0) {
+        return true;
+    }
+    if (check_only) {
+        // Nothing is written with -n, the image is checked as it is
+        if (read_journal(journal_path(), &header, &blocks, &undo, &redo)) {
+            if (header.state == JOURNAL_PENDING) {
+                notice("Interrupted repair in %s not replayed (-n)\n", journal_path());
+            }
+            free(blocks);
+            free(undo);
+            free(redo);
+        }
+        return true;
+    }
+    if (!read_journal(journal_path(), &header, &blocks, &undo, &redo)) {
+        // Torn journal: the image was not written yet
+        notice("Discarding incomplete journal %s\n", journal_path());
+        unlink(journal_path());
+        return true;
+    }
+
+    bool ok = true;
+    if (header.state == JOURNAL_PENDING) {
+        notice("Replaying interrupted repair from %s (%u blocks)\n", journal_path(), header.count);
+        ok = apply_journal_side(blocks, redo, header.count);
+        if (!ok) {
+            notice("Error replaying journal %s\n", journal_path());
+        }
+    }
+    if (ok && header.state == JOURNAL_PENDING) {
+        int jfd = open(journal_path(), O_WRONLY);
+        uint32_t state = JOURNAL_APPLIED;
+        if (jfd != -1) {
+            pwrite_full(jfd, &state, sizeof(state), offsetof(journal_header_t, state));
+            close(jfd);
+        }
+    }
+    free(blocks);
+    free(undo);
+    free(redo);
+    return ok;
+}
+
+// --rollback: puts back the blocks the last repair changed and drops its journal
+bool rollback_journal() {
+    journal_header_t header;
+    uint32_t *blocks;
+    uint8_t *undo, *redo;
+    if (!read_journal(journal_path(), &header, &blocks, &undo, &redo)) {
+        notice("No usable journal to roll back: %s\n", journal_path());
+        return false;
+    }
+
+    bool ok = apply_journal_side(blocks, undo, header.count);
+    if (ok) {
+        unlink(journal_path());
+        notice("Rolled back %u blocks from %s\n", header.count, journal_path());
+    } else {
+        notice("Error rolling back from %s\n", journal_path());
+    }
+    free(blocks);
+    free(undo);
+    free(redo);
+    return ok;
+}
+
+
+
+//Checks if a bit is set in the bitmap
+
+bool is_used_bit(uint8_t *bitmap, int bit_index) {
+    int byte_index = bit_index / 8;
+    int bit_offset = bit_index % 8;
+    return (bitmap[byte_index] & (1 << bit_offset)) != 0;
+}
+
+
+//Sets a bit in the bitmap
+
+void set_bit(uint8_t *bitmap, int bit_index) {
+    int byte_index = bit_index / 8;
+    int bit_offset = bit_index % 8;
+    bitmap[byte_index] |= (1 << bit_offset);
+}
+
+
+//Clears a bit in the bitmap
+
+void clear_bit(uint8_t *bitmap, int bit_index) {
+    int byte_index = bit_index / 8;
+    int bit_offset = bit_index % 8;
+    bitmap[byte_index] &= ~(1 << bit_offset);
+}
+
+
+bool is_valid_inode(const inode_t *inode) {
+    return ((*inode).links_count > 0 && (*inode).dtime == 0);
+}
+
+
+bool check_superblock() {
+    
+    if (!fs->meta_read_ok[SUPERBLOCK_BLOCK_NUM]) {
+        report(SB_READ, -1, SUPERBLOCK_BLOCK_NUM, 0, 0, 0, 0);
+        fs->superblock_errors++;
+        return false;
+    }
+
+    // Each field against the geometry the image is checked with
+    uint32_t fields[][3] = {
+        { SB_MAGIC, fs->superblock->magic, VSFS_MAGIC },
+        { SB_BLOCK_SIZE, fs->superblock->block_size, BLOCK_SIZE },
+        { SB_TOTAL_BLOCKS, fs->superblock->total_blocks, fs->total_blocks },
+        { SB_INODE_BITMAP_BLOCK, fs->superblock->inode_bitmap_block, fs->inode_bitmap_block },
+        { SB_DATA_BITMAP_BLOCK, fs->superblock->data_bitmap_block, fs->data_bitmap_block },
+        { SB_INODE_TABLE_BLOCK, fs->superblock->inode_table_block, fs->inode_table_block },
+        { SB_DATA_BLOCK_START, fs->superblock->data_block_start, fs->data_block_start },
+        { SB_INODE_SIZE, fs->superblock->inode_size, INODE_SIZE },
+        { SB_INODE_COUNT, fs->superblock->inode_count, fs->inode_count },
+    };
+
+    bool is_valid = true;
+    for (size_t k = 0; k < sizeof(fields) / sizeof(fields[0]); k++) {
+        if (fields[k][1] != fields[k][2]) {
+            report(fields[k][0], -1, SUPERBLOCK_BLOCK_NUM, 0, 0, fields[k][1], fields[k][2]);
+            is_valid = false;
+            fs->superblock_errors++;
+        }
+    }
+
+    if (is_valid) {
+        say("Superblock check: PASSED\n");
+    } else {
+        say("Superblock check: FAILED\n");
+    }
+
+    return is_valid;
+}
+
+
+
+
+
+bool check_inode_bitmap() {
+    say("Checking inode bitmap...\n");
+    
+    fs->inode_bitmap_errors = 0;
+    int type1_errors = 0;  // Invalid inodes marked used
+    int type2_errors = 0;  // Valid inodes not marked used
+    
+    // Inode bitmap as loaded from disk
+    if (!region_read_ok(fs->inode_bitmap_block, fs->data_bitmap_block)) {
+        report(INODE_BITMAP_READ, -1, fs->inode_bitmap_block, 0, 0, 0, 0);
+        fs->inode_bitmap_errors++;
+        return false;
+    }
+    
+    // Compare against the valid inodes found by the walk a word at a time, only
+    // differing words are looked at bit by bit
+    for (size_t k = next_diff_word(fs->inode_bitmap, fs->valid_inodes, fs->valid_inodes, 0, fs->inode_count);
+         k < fs->inode_map_words;
+         k = next_diff_word(fs->inode_bitmap, fs->valid_inodes, fs->valid_inodes, k + 1, fs->inode_count)) {
+        uint64_t on_disk;
+        uint64_t diff = diff_word(fs->inode_bitmap, fs->valid_inodes, fs->valid_inodes, k, fs->inode_count, &on_disk);
+
+        while (diff != 0) {
+            int bit = __builtin_ctzll(diff);
+            int i = (int)(k * 64 + bit);
+
+            // Type 1 error: Inode is marked as used but is invalid
+            if ((on_disk >> bit) & 1) {
+                report(INODE_MARKED_INVALID, i, 0, 0, 0, 0, 0);
+                type1_errors++;
+            }
+            // Type 2 error: Inode is valid but not marked as used
+            else {
+                report(INODE_VALID_UNMARKED, i, 0, 0, 0, 0, 0);
+                type2_errors++;
+            }
+            diff &= diff - 1;
+        }
+    }
+    
+    
+    fs->inode_bitmap_errors = type1_errors + type2_errors;
+    
+    
+    if (fs->inode_bitmap_errors > 0) {
+        say("Inode bitmap errors summary: %d errors\n", fs->inode_bitmap_errors);
+        say("  - Invalid inodes marked as used: %d\n", type1_errors);
+        say("  - Valid inodes not marked as used: %d\n", type2_errors);
+    }
+    
+    return (fs->inode_bitmap_errors == 0);
+}
+ 
+// Rebuilds inode_columns, valid_inodes and outlier_inodes from the inode table
+bool build_valid_inode_map() {
+    if (!build_inode_columns()) {
+        return false;
+    }
+    classify_inodes();
+    return true;
+}
+
+// Copies the fields the checks read out of the 256-byte inodes into
+// inode_columns, so the kernels below stream 4 bytes per inode and field
+bool build_inode_columns() {
+    inode_columns_t *c = &fs->inode_columns;
+    if (c->links_count == NULL) {
+        c->count = fs->inode_map_words * 64;
+        uint32_t **columns[] = { &c->links_count, &c->dtime, &c->direct_block,
+                                 &c->roots[0], &c->roots[1], &c->roots[2] };
+        for (size_t k = 0; k < sizeof(columns) / sizeof(columns[0]); k++) {
+            *columns[k] = calloc(c->count, sizeof(uint32_t));
+            if (*columns[k] == NULL) {
+                return false;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < fs->inode_count; i++) {
+        const inode_t *inode = &fs->inode_table[i];
+        c->links_count[i] = inode->links_count;
+        c->dtime[i] = inode->dtime;
+        c->direct_block[i] = inode->direct_block;
+        c->roots[0][i] = inode->single_indirect;
+        c->roots[1][i] = inode->double_indirect;
+        c->roots[2][i] = inode->triple_indirect;
+    }
+    return true;
+}
+
+void free_inode_columns() {
+    inode_columns_t *c = &fs->inode_columns;
+    free(c->links_count);
+    free(c->dtime);
+    free(c->direct_block);
+    for (int level = 0; level < MAX_INDIRECT_LEVEL; level++) {
+        free(c->roots[level]);
+    }
+    memset(c, 0, sizeof(*c));
+}
+
+// Valid and outlier bits of inodes [64 * k, 64 * k + 64). An outlier is a
+// valid inode the walk has to look at more closely than its direct block: the
+// direct pointer is out of range or it has an indirect root.
+void classify_inodes_scalar(size_t k, uint64_t *valid, uint64_t *outlier) {
+    const inode_columns_t *c = &fs->inode_columns;
+    uint32_t span = fs->total_blocks - fs->data_block_start;
+    *valid = *outlier = 0;
+    for (size_t i = k * 64; i < k * 64 + 64; i++) {
+        bool is_valid = c->links_count[i] > 0 && c->dtime[i] == 0;
+        uint32_t direct = c->direct_block[i];
+        bool direct_bad = direct != 0 && direct - fs->data_block_start >= span;
+        bool has_roots = (c->roots[0][i] | c->roots[1][i] | c->roots[2][i]) != 0;
+        *valid |= (uint64_t)is_valid << (i % 64);
+        *outlier |= (uint64_t)(is_valid && (direct_bad || has_roots)) << (i % 64);
+    }
+}
+
+#ifdef HAVE_AVX2_KERNEL
+// Same as the scalar kernel, 8 inodes per step. The unsigned range test
+// (p - start < span) is a signed compare after flipping the sign bits.
+__attribute__((target("avx2")))
+void classify_inodes_avx2(size_t k, uint64_t *valid, uint64_t *outlier) {
+    const inode_columns_t *c = &fs->inode_columns;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    const __m256i start = _mm256_set1_epi32((int)fs->data_block_start);
+    const __m256i span = _mm256_xor_si256(_mm256_set1_epi32((int)(fs->total_blocks - fs->data_block_start)), sign);
+    *valid = *outlier = 0;
+    for (size_t i = k * 64; i < k * 64 + 64; i += 8) {
+        __m256i links = _mm256_loadu_si256((const __m256i *)(c->links_count + i));
+        __m256i dtime = _mm256_loadu_si256((const __m256i *)(c->dtime + i));
+        __m256i direct = _mm256_loadu_si256((const __m256i *)(c->direct_block + i));
+        __m256i roots = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(c->roots[0] + i)),
+                        _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(c->roots[1] + i)),
+                                        _mm256_loadu_si256((const __m256i *)(c->roots[2] + i))));
+
+        __m256i is_valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(links, zero), _mm256_cmpeq_epi32(dtime, zero));
+        __m256i in_range = _mm256_cmpgt_epi32(span, _mm256_xor_si256(_mm256_sub_epi32(direct, start), sign));
+        __m256i direct_ok = _mm256_or_si256(in_range, _mm256_cmpeq_epi32(direct, zero));
+        __m256i simple = _mm256_and_si256(direct_ok, _mm256_cmpeq_epi32(roots, zero));
+
+        uint64_t v = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(is_valid));
+        uint64_t o = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(simple, is_valid)));
+        *valid |= v << (i % 64);
+        *outlier |= o << (i % 64);
+    }
+}
+#endif
+
+// Fills valid_inodes and outlier_inodes from inode_columns, 64 inodes at a time
+void classify_inodes() {
+    for (size_t k = 0; k < fs->inode_map_words; k++) {
+        classify_kernel(k, &fs->valid_inodes[k], &fs->outlier_inodes[k]);
+    }
+}
+
+// Word k of an on-disk bitmap (bytes, bit i in byte i / 8) as a little-endian 64-bit word
+uint64_t load_bitmap_word(const uint8_t *bitmap, size_t k) {
+    uint64_t word;
+    memcpy(&word, bitmap + k * 8, sizeof(word));
+    return word;
+}
+
+// Bits of word k where the disk bitmap differs from (a | b), limited to the first nbits bits
+uint64_t diff_word(const uint8_t *disk, const uint64_t *a, const uint64_t *b, size_t k, size_t nbits,
+                   uint64_t *on_disk) {
+    *on_disk = load_bitmap_word(disk, k);
+    uint64_t diff = *on_disk ^ (a[k] | b[k]);
+    if ((k + 1) * 64 > nbits) {
+        diff &= (1ULL << (nbits % 64)) - 1; // Ignore bits past the last block or inode
+    }
+    return diff;
+}
+
+size_t next_diff_word_scalar(const uint8_t *disk, const uint64_t *a, const uint64_t *b, size_t k, size_t full) {
+    for (; k < full; k++) {
+        if (load_bitmap_word(disk, k) != (a[k] | b[k])) {
+            break;
+        }
+    }
+    return k;
+}
+
+#ifdef HAVE_AVX2_KERNEL
+// Same as the scalar kernel, 256 bits per step
+__attribute__((target("avx2")))
+size_t next_diff_word_avx2(const uint8_t *disk, const uint64_t *a, const uint64_t *b, size_t k, size_t full) {
+    for (; k + 4 <= full; k += 4) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(disk + k * 8));
+        __m256i e = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(a + k)),
+                                    _mm256_loadu_si256((const __m256i *)(b + k)));
+        __m256i x = _mm256_xor_si256(d, e);
+        if (!_mm256_testz_si256(x, x)) {
+            break;
+        }
+    }
+    return next_diff_word_scalar(disk, a, b, k, full);
+}
+#endif
+
+// Index of the first word at or after k where the disk bitmap differs from
+// (a | b) over the first nbits bits, or the word count if there is none
+size_t next_diff_word(const uint8_t *disk, const uint64_t *a, const uint64_t *b, size_t k, size_t nbits) {
+    size_t full = nbits / 64;
+    size_t words = DIV_ROUND_UP(nbits, 64);
+    k = next_diff_kernel(disk, a, b, k, full);
+    if (k == full && full < words) {
+        // Partial last word
+        uint64_t on_disk;
+        if (diff_word(disk, a, b, k, nbits, &on_disk) == 0) {
+            k = words;
+        }
+    }
+    return k;
+}
+
+// Picks the bitmap kernels for this CPU, once before any thread uses them
+void select_kernels() {
+    classify_kernel = classify_inodes_scalar;
+    next_diff_kernel = next_diff_word_scalar;
+#ifdef HAVE_AVX2_KERNEL
+    if (__builtin_cpu_supports("avx2")) {
+        classify_kernel = classify_inodes_avx2;
+        next_diff_kernel = next_diff_word_avx2;
+    }
+#endif
+    page_size = sysconf(_SC_PAGESIZE);
+}
+
+// Writes (a | b) over the first nbits bits of an on-disk bitmap
+void store_bitmap_words(uint8_t *disk, const uint64_t *a, const uint64_t *b, size_t nbits) {
+    size_t full = nbits / 64;
+    for (size_t k = 0; k < full; k++) {
+        uint64_t word = a[k] | b[k];
+        memcpy(disk + k * 8, &word, sizeof(word));
+    }
+    for (size_t i = full * 64; i < nbits; i++) {
+        if (((a[i / 64] | b[i / 64]) >> (i % 64)) & 1) {
+            set_bit(disk, (int)i);
+        }
+    }
+}
+
+// First bit in [from, end) of an on-disk bitmap that is set (or clear, when
+// set is false), or end if there is none
+size_t next_bit(const uint8_t *disk, size_t from, size_t end, bool set) {
+    if (from >= end) {
+        return end;
+    }
+    uint64_t flip = set ? 0 : ~0ULL;
+    size_t k = from / 64;
+    uint64_t word = (load_bitmap_word(disk, k) ^ flip) & (~0ULL << (from % 64));
+    while (word == 0) {
+        if (++k * 64 >= end) {
+            return end;
+        }
+        word = load_bitmap_word(disk, k) ^ flip;
+    }
+    size_t i = k * 64 + __builtin_ctzll(word);
+    return i < end ? i : end;
+}
+
+// Sets bits [first, end) of an on-disk bitmap, whole bytes at a time
+void set_bit_range(uint8_t *disk, size_t first, size_t end) {
+    for (; first < end && first % 8 != 0; first++) {
+        set_bit(disk, (int)first);
+    }
+    size_t bytes = (end - first) / 8;
+    memset(disk + first / 8, 0xff, bytes);
+    for (first += bytes * 8; first < end; first++) {
+        set_bit(disk, (int)first);
+    }
+}
+
+//Checks data bitmap consistency
+
+bool check_data_bitmap() {
+    
+    if (!region_read_ok(fs->data_bitmap_block, fs->inode_table_block)) {
+        report(DATA_BITMAP_READ, -1, fs->data_bitmap_block, 0, 0, 0, 0);
+        fs->data_bitmap_errors++;
+        return false;
+    }
+
+    bool is_valid = true;
+
+    // Every used extent must be all ones in the bitmap and every gap between
+    // them all zeros, each searched a word at a time
+    size_t nbits = fs->total_blocks - fs->data_block_start;
+    size_t gap = 0;
+    for (size_t e = 0; e <= fs->used_count; e++) {
+        size_t first = e < fs->used_count ? fs->used_extents[e].first - fs->data_block_start : nbits;
+        size_t end = e < fs->used_count ? fs->used_extents[e].end - fs->data_block_start : nbits;
+
+        // Check that every block marked as used in the bitmap is actually used
+        for (size_t i = next_bit(fs->data_bitmap, gap, first, true); i < first;
+             i = next_bit(fs->data_bitmap, i + 1, first, true)) {
+            report(BLOCK_MARKED_UNUSED, -1, fs->data_block_start + (uint32_t)i, 0, 0, 0, 0);
+            is_valid = false;
+            fs->data_bitmap_errors++;
+        }
+
+        // Block is marked as free, but actually used
+        for (size_t i = next_bit(fs->data_bitmap, first, end, false); i < end;
+             i = next_bit(fs->data_bitmap, i + 1, end, false)) {
+            report(BLOCK_USED_UNMARKED, -1, fs->data_block_start + (uint32_t)i, 0, 0, 0, 0);
+            is_valid = false;
+            fs->data_bitmap_errors++;
+        }
+        gap = end;
+    }
+
+    if (is_valid) {
+        say("Data bitmap check: PASSED\n");
+    } else {
+        say("Data bitmap check: FAILED\n");
+    }
+
+    return is_valid;
+}
+
+//Checks for duplicate block references
+bool check_duplicates() {
+    bool is_valid = true;
+    for (size_t e = 0; e < fs->dup_count; e++) {
+        for (uint32_t i = fs->dup_extents[e].first; i < fs->dup_extents[e].end; i++) {
+            size_t count;
+            size_t first = find_owners(i, &count);
+
+            if (fs->format == FORMAT_TEXT) {
+                printf("Error: Block %u is referenced by multiple inodes (", i);
+                for (size_t k = 0; k < count; k++) {
+                    printf("%s%d", k ? ", " : "", fs->dup_owners[first + k].inode);
+                }
+                printf(")\n");
+            } else {
+                // One record per reference
+                for (size_t k = 0; k < count; k++) {
+                    report(DUPLICATE_BLOCK, fs->dup_owners[first + k].inode, i, 0, 0, count, 0);
+                }
+            }
+            fs->duplicate_block_errors++;
+            is_valid = false;
+        }
+    }
+
+    if (is_valid) {
+        say("Duplicate blocks check: PASSED\n");
+    } else {
+        say("Duplicate blocks check: FAILED\n");
+    }
+
+    return is_valid;
+}
+
+//Checks if a block is set in a block bitmap
+bool is_block_marked(const uint64_t *map, uint32_t block_num) {
+    return (map[block_num / 64] >> (block_num % 64)) & 1;
+}
+
+//Sets a block in a block bitmap
+void mark_block(uint64_t *map, uint32_t block_num) {
+    map[block_num / 64] |= 1ULL << (block_num % 64);
+}
+
+// Makes room for one more extent
+bool grow_extents(extent_t **list, size_t *count, size_t *cap) {
+    if (*count < *cap) {
+        return true;
+    }
+    size_t grown_cap = *cap ? *cap * 2 : 64;
+    extent_t *grown = realloc(*list, grown_cap * sizeof(extent_t));
+    if (grown == NULL) {
+        return false;
+    }
+    *list = grown;
+    *cap = grown_cap;
+    return true;
+}
+
+// Appends [first, end) to a sorted list, joining it with the last extent when
+// they overlap or touch
+bool push_extent(extent_t **list, size_t *count, size_t *cap, uint32_t first, uint32_t end) {
+    if (*count > 0 && first <= (*list)[*count - 1].end) {
+        if (end > (*list)[*count - 1].end) {
+            (*list)[*count - 1].end = end;
+        }
+        return true;
+    }
+    if (!grow_extents(list, count, cap)) {
+        return false;
+    }
+    (*list)[*count].first = first;
+    (*list)[*count].end = end;
+    (*count)++;
+    return true;
+}
+
+// Index of the first extent of a sorted list that ends after block_num, count if none does
+size_t find_extent(const extent_t *list, size_t count, uint32_t block_num) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list[mid].end <= block_num) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool in_extents(const extent_t *list, size_t count, uint32_t block_num) {
+    size_t k = find_extent(list, count, block_num);
+    return k < count && list[k].first <= block_num;
+}
+
+int compare_extents(const void *a, const void *b) {
+    const extent_t *x = a, *y = b;
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+// Sorts the extents of every walker by their first block and sweeps them
+// once. A block is duplicated when an extent starts before the extents
+// sorted ahead of it end, so the result depends on the number of extents,
+// not on the number of blocks.
+bool merge_references(walker_t *walkers, int threads) {
+    free(fs->used_extents);
+    free(fs->dup_extents);
+    fs->used_extents = fs->dup_extents = NULL;
+    fs->used_count = fs->used_cap = fs->dup_count = 0;
+
+    size_t total = 0;
+    for (int t = 0; t < threads; t++) {
+        total += walkers[t].extent_count;
+    }
+    extent_t *all = malloc((total ? total : 1) * sizeof(extent_t));
+    if (all == NULL) {
+        return false;
+    }
+    size_t n = 0;
+    for (int t = 0; t < threads; t++) {
+        if (walkers[t].extent_count > 0) {
+            memcpy(all + n, walkers[t].extents, walkers[t].extent_count * sizeof(extent_t));
+            n += walkers[t].extent_count;
+        }
+    }
+    qsort(all, total, sizeof(extent_t), compare_extents);
+
+    bool ok = true;
+    size_t dup_cap = 0;
+    for (size_t k = 0; k < total && ok; k++) {
+        if (fs->used_count > 0 && all[k].first < fs->used_extents[fs->used_count - 1].end) {
+            uint32_t reach = fs->used_extents[fs->used_count - 1].end;
+            ok = push_extent(&fs->dup_extents, &fs->dup_count, &dup_cap, all[k].first,
+                             all[k].end < reach ? all[k].end : reach);
+        }
+        ok = ok && push_extent(&fs->used_extents, &fs->used_count, &fs->used_cap, all[k].first, all[k].end);
+    }
+    free(all);
+    return ok;
+}
+
+// Records a block allocated by a fix as referenced
+void add_used_block(uint32_t block_num) {
+    size_t k = find_extent(fs->used_extents, fs->used_count, block_num);
+    bool after = k > 0 && fs->used_extents[k - 1].end == block_num;
+    bool before = k < fs->used_count && fs->used_extents[k].first == block_num + 1;
+    if (after && before) {
+        fs->used_extents[k - 1].end = fs->used_extents[k].end;
+        memmove(&fs->used_extents[k], &fs->used_extents[k + 1], (fs->used_count - k - 1) * sizeof(extent_t));
+        fs->used_count--;
+    } else if (after) {
+        fs->used_extents[k - 1].end++;
+    } else if (before) {
+        fs->used_extents[k].first--;
+    } else if (grow_extents(&fs->used_extents, &fs->used_count, &fs->used_cap)) {
+        memmove(&fs->used_extents[k + 1], &fs->used_extents[k], (fs->used_count - k) * sizeof(extent_t));
+        fs->used_extents[k].first = block_num;
+        fs->used_extents[k].end = block_num + 1;
+        fs->used_count++;
+    }
+    // Out of memory: alloc_hint still keeps the block from being handed out twice
+}
+
+bool is_block_used(uint32_t block_num) {
+    return in_extents(fs->used_extents, fs->used_count, block_num);
+}
+
+// Records one reference, or in the owner pass lists it if the block is duplicated
+void note_reference(walker_t *w, uint32_t block_num, int inode_num) {
+    if (!w->collect_owners) {
+        // Only a block right after the last one extends it, a repeated block
+        // starts a new extent so the merge sees it twice
+        if (w->extent_count > 0 && w->extents[w->extent_count - 1].end == block_num) {
+            w->extents[w->extent_count - 1].end++;
+        } else if (grow_extents(&w->extents, &w->extent_count, &w->extent_cap)) {
+            w->extents[w->extent_count].first = block_num;
+            w->extents[w->extent_count].end = block_num + 1;
+            w->extent_count++;
+        } else {
+            w->out_of_memory = true;
+        }
+        return;
+    }
+    if (!in_extents(fs->dup_extents, fs->dup_count, block_num)) {
+        return;
+    }
+    if (w->owner_count == w->owner_cap) {
+        size_t cap = w->owner_cap ? w->owner_cap * 2 : 64;
+        block_owner_t *grown = realloc(w->owners, cap * sizeof(block_owner_t));
+        if (grown == NULL) {
+            w->out_of_memory = true;
+            return;
+        }
+        w->owners = grown;
+        w->owner_cap = cap;
+    }
+    w->owners[w->owner_count].block = block_num;
+    w->owners[w->owner_count].inode = inode_num;
+    w->owner_count++;
+}
+
+void add_finding(walker_t *w, int kind, int inode_num, uint32_t block_num, int level, uint32_t parent) {
+    if (w->collect_owners) {
+        return; // Already reported by the counting pass
+    }
+    if (w->finding_count == w->finding_cap) {
+        size_t cap = w->finding_cap ? w->finding_cap * 2 : 64;
+        finding_t *grown = realloc(w->findings, cap * sizeof(finding_t));
+        if (grown == NULL) {
+            w->out_of_memory = true;
+            return;
+        }
+        w->findings = grown;
+        w->finding_cap = cap;
+    }
+    finding_t *f = &w->findings[w->finding_count++];
+    f->kind = kind;
+    f->inode = inode_num;
+    f->block = block_num;
+    f->level = level;
+    f->parent = parent;
+    f->value = 0;
+    f->expected = 0;
+}
+
+void print_finding(const finding_t *f) {
+    static const char *root_names[] = { "", "single", "double", "triple" };
+    static const char *sb_field_names[] = {
+        "block size", "total blocks", "inode bitmap block number", "data bitmap block number",
+        "inode table start block number", "data block start number", "inode size", "inode count"
+    };
+
+    switch (f->kind) {
+    case BAD_DIRECT:
+        printf("Error: Inode %d has invalid direct block %u (valid range: %u-%u)\n",
+               f->inode, f->block, fs->data_block_start, fs->total_blocks-1);
+        break;
+    case BAD_INDIRECT_ROOT:
+        printf("Error: Inode %d has invalid %s indirect block %u\n",
+               f->inode, root_names[f->level], f->block);
+        break;
+    case BAD_CYCLE:
+        printf("Error: Inode %d has a cycle: level-%d indirect block %u points back to block %u\n",
+               f->inode, f->level, f->parent, f->block);
+        break;
+    case BAD_INDIRECT_READ:
+        printf("Error: Could not read indirect block %u (level %d) for inode %d\n",
+               f->block, f->level, f->inode);
+        break;
+    case BAD_POINTER:
+        printf("Error: Inode %d has invalid block pointer %u in level-%d indirect block %u\n",
+               f->inode, f->block, f->level, f->parent);
+        break;
+    case SB_READ:
+        printf("Error reading superblock\n");
+        break;
+    case SB_MAGIC:
+        printf("Error: Invalid superblock magic number (0x%04X, expected 0x%04X)\n", f->value, f->expected);
+        break;
+    case SB_BLOCK_SIZE:
+    case SB_TOTAL_BLOCKS:
+    case SB_INODE_BITMAP_BLOCK:
+    case SB_DATA_BITMAP_BLOCK:
+    case SB_INODE_TABLE_BLOCK:
+    case SB_DATA_BLOCK_START:
+    case SB_INODE_SIZE:
+    case SB_INODE_COUNT:
+        printf("Error: Invalid %s (%u, expected %u)\n", sb_field_names[f->kind - SB_BLOCK_SIZE],
+               f->value, f->expected);
+        break;
+    case INODE_BITMAP_READ:
+        fprintf(stderr, "Error reading inode bitmap\n");
+        break;
+    case INODE_MARKED_INVALID:
+        printf("Error: Inode %d is marked as used but is invalid\n", f->inode);
+        break;
+    case INODE_VALID_UNMARKED:
+        printf("Error: Inode %d is valid but not marked as used\n", f->inode);
+        break;
+    case DATA_BITMAP_READ:
+        fprintf(stderr, "Error reading data bitmap\n");
+        break;
+    case BLOCK_MARKED_UNUSED:
+        printf("Error: Block %u is marked as used in bitmap but not actually used\n", f->block);
+        break;
+    case BLOCK_USED_UNMARKED:
+        printf("Error: Block %u is used but not marked in bitmap\n", f->block);
+        break;
+    case DUPLICATE_BLOCK:
+        printf("Error: Block %u is referenced by inode %d (%u references)\n", f->block, f->inode, f->value);
+        break;
+    }
+}
+
+// Human readable output, nothing is formatted with --format=json or binary
+void say(const char *format, ...) {
+    if (fs->format != FORMAT_TEXT) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+// Problems that stop or weaken the check, kept off stdout in the machine formats.
+// In batch mode they go to stderr prefixed with the image, one line per call.
+void notice(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (fs->format == FORMAT_NONE) {
+        char line[1024];
+        vsnprintf(line, sizeof(line), format, args);
+        fprintf(stderr, "%s: %s", fs->path, line);
+    } else {
+        vfprintf(fs->format == FORMAT_TEXT ? stdout : stderr, format, args);
+    }
+    va_end(args);
+}
+
+void report(int kind, int inode_num, uint32_t block_num, int level, uint32_t parent, uint32_t value,
+            uint32_t expected) {
+    finding_t f = { kind, inode_num, block_num, level, parent, value, expected };
+    report_finding(&f);
+}
+
+// Prints a finding, or records it in the JSON or binary report
+void report_finding(const finding_t *f) {
+    if (fs->format == FORMAT_TEXT) {
+        print_finding(f);
+        return;
+    }
+    report_record_t r = { .type = REC_FINDING, .kind = f->kind, .pass = fs->report_pass, .level = f->level,
+                          .inode = f->inode, .block = f->block, .parent = f->parent,
+                          .v = { f->value, f->expected } };
+    emit_record(&r);
+}
+
+// Binary records are streamed as they come, JSON is written at the end
+void emit_record(const report_record_t *r) {
+    if (fs->format == FORMAT_NONE) {
+        return;
+    }
+    if (fs->format == FORMAT_BINARY) {
+        fwrite(r, sizeof(*r), 1, stdout);
+        return;
+    }
+    if (fs->report_record_count == fs->report_record_cap) {
+        size_t cap = fs->report_record_cap ? fs->report_record_cap * 2 : 256;
+        report_record_t *grown = realloc(fs->report_records, cap * sizeof(report_record_t));
+        if (grown == NULL) {
+            return;
+        }
+        fs->report_records = grown;
+        fs->report_record_cap = cap;
+    }
+    fs->report_records[fs->report_record_count++] = *r;
+}
+
+void count_read(uint64_t bytes) {
+    __atomic_fetch_add(&fs->bytes_read, bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+// Starts timing a phase, ending the one before it
+void begin_phase(int phase) {
+    end_phase();
+    fs->current_phase = phase;
+    clock_gettime(CLOCK_MONOTONIC, &fs->phase_wall_start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &fs->phase_cpu_start);
+    fs->phase_bytes_start = __atomic_load_n(&fs->bytes_read, __ATOMIC_RELAXED);
+}
+
+void end_phase() {
+    if (fs->current_phase < 0) {
+        return;
+    }
+    struct timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    fs->phase_wall_ns[fs->current_phase] += elapsed_ns(&fs->phase_wall_start, &wall);
+    if (fs->format != FORMAT_TEXT) {
+        report_record_t r = { .type = REC_PHASE, .kind = fs->current_phase, .pass = fs->report_pass,
+                              .v = { elapsed_ns(&fs->phase_wall_start, &wall), elapsed_ns(&fs->phase_cpu_start, &cpu),
+                                     __atomic_load_n(&fs->bytes_read, __ATOMIC_RELAXED) - fs->phase_bytes_start } };
+        emit_record(&r);
+    }
+    fs->current_phase = -1;
+}
+
+// Ends the report: the binary end record, or the whole JSON document
+void finish_report() {
+    int errors = fs->superblock_errors + fs->inode_bitmap_errors + fs->data_bitmap_errors +
+                 fs->duplicate_block_errors + fs->bad_block_errors;
+    if (fs->format == FORMAT_BINARY) {
+        report_record_t r = { .type = REC_END, .v = { errors } };
+        emit_record(&r);
+        fflush(stdout);
+        return;
+    }
+    if (fs->format != FORMAT_JSON) {
+        return;
+    }
+
+    printf("{\"version\":%d,\"image\":", REPORT_VERSION);
+    print_json_string(fs->path);
+    printf(",\"block_size\":%d,\"total_blocks\":%u,\"inode_count\":%u,\"passes\":[",
+           BLOCK_SIZE, fs->total_blocks, fs->inode_count);
+    print_json_pass(0);
+    if (fs->report_pass == 1) {
+        printf(",");
+        print_json_pass(1);
+    }
+    printf("],\"consistent\":%s,\"bytes_read\":%llu}\n", errors == 0 ? "true" : "false",
+           (unsigned long long)fs->bytes_read);
+    free(fs->report_records);
+    fs->report_records = NULL;
+    fs->report_record_count = fs->report_record_cap = 0;
+}
+
+void print_json_string(const char *str) {
+    putchar('"');
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            printf("\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            printf("\\u%04x", *str);
+        } else {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+// Errors, findings and phase times of one pass
+void print_json_pass(int pass) {
+    static const char *kind_names[FINDING_KINDS] = {
+        "bad_direct", "bad_indirect_root", "cycle", "indirect_read", "bad_pointer",
+        "superblock_read", "superblock_magic", "superblock_block_size", "superblock_total_blocks",
+        "superblock_inode_bitmap_block", "superblock_data_bitmap_block", "superblock_inode_table_block",
+        "superblock_data_block_start", "superblock_inode_size", "superblock_inode_count",
+        "inode_bitmap_read", "inode_marked_invalid", "inode_valid_unmarked",
+        "data_bitmap_read", "block_marked_unused", "block_used_unmarked", "duplicate_block"
+    };
+    static const char *count_names[] = { "superblock", "inode_bitmap", "data_bitmap", "duplicates", "bad_blocks" };
+    static const char *phase_names[PHASE_COUNT] = {
+        "load", "walk", "superblock", "inode_bitmap", "data_bitmap", "duplicates", "bad_blocks", "fix"
+    };
+
+    printf("{\"pass\":\"%s\",\"errors\":{", pass == 0 ? "check" : "recheck");
+    bool first = true;
+    for (size_t k = 0; k < fs->report_record_count; k++) {
+        const report_record_t *r = &fs->report_records[k];
+        if (r->type == REC_COUNT && r->pass == pass) {
+            printf("%s\"%s\":%llu", first ? "" : ",", count_names[r->kind], (unsigned long long)r->v[0]);
+            first = false;
+        }
+    }
+
+    printf("},\"findings\":[");
+    first = true;
+    for (size_t k = 0; k < fs->report_record_count; k++) {
+        const report_record_t *r = &fs->report_records[k];
+        if (r->type == REC_FINDING && r->pass == pass) {
+            printf("%s{\"kind\":\"%s\",\"inode\":%d,\"block\":%u,\"level\":%u,\"parent\":%u,"
+                   "\"value\":%llu,\"expected\":%llu}",
+                   first ? "" : ",", kind_names[r->kind], r->inode, r->block, r->level, r->parent,
+                   (unsigned long long)r->v[0], (unsigned long long)r->v[1]);
+            first = false;
+        }
+    }
+
+    printf("],\"phases\":[");
+    first = true;
+    for (size_t k = 0; k < fs->report_record_count; k++) {
+        const report_record_t *r = &fs->report_records[k];
+        if (r->type == REC_PHASE && r->pass == pass) {
+            printf("%s{\"phase\":\"%s\",\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"bytes_read\":%llu}",
+                   first ? "" : ",", phase_names[r->kind], r->v[0] / 1e6, r->v[1] / 1e6,
+                   (unsigned long long)r->v[2]);
+            first = false;
+        }
+    }
+    printf("]}");
+}
+
+// Walk buffers, allocated once per walker and reused for every inode
+bool init_walker(walker_t *w) {
+    w->visited = calloc(fs->block_map_words, sizeof(uint64_t));
+    w->visited_twice = calloc(fs->block_map_words, sizeof(uint64_t));
+#ifdef HAVE_IO_URING
+    w->ring.fd = -1;
+#endif
+
+    // Mapped images are read in place, read-ahead only needs buffers otherwise
+    size_t buffers = MAX_INDIRECT_LEVEL;
+    if (fs->map == NULL) {
+        buffers += (MAX_INDIRECT_LEVEL - 1) * READAHEAD_WINDOW;
+    }
+    w->pool = malloc(buffers * sizeof(*w->pool));
+    if (w->pool == NULL || w->visited == NULL || w->visited_twice == NULL) {
+        return false;
+    }
+    if (fs->map == NULL) {
+        for (int d = 0; d < MAX_INDIRECT_LEVEL - 1; d++) {
+            w->ahead[d].buf = w->pool + MAX_INDIRECT_LEVEL + d * READAHEAD_WINDOW;
+        }
+#ifdef HAVE_IO_URING
+        if (use_uring) {
+            uring_init(&w->ring, (MAX_INDIRECT_LEVEL - 1) * READAHEAD_WINDOW);
+        }
+#endif
+    }
+    return true;
+}
+
+void free_walker(walker_t *w) {
+    // The kernel may still be writing into the pool
+    for (int d = 0; d < MAX_INDIRECT_LEVEL - 1; d++) {
+        drain_readahead(w, d);
+    }
+#ifdef HAVE_IO_URING
+    uring_free(&w->ring);
+#endif
+    free(w->pool);
+    free(w->visited);
+    free(w->visited_twice);
+    free(w->visited_list);
+    free(w->extents);
+}
+
+// Marks an indirect block as walked for the current inode, false if it already
+// was walked twice. A second walk counts everything below a block the inode
+// reaches from two places once more, so all of it is found duplicated. Later
+// walks would add nothing the checks can see, and would make the work grow
+// with the number of paths instead of the number of blocks.
+bool visit_indirect(walker_t *w, uint32_t block_num) {
+    uint32_t index = block_num - fs->data_block_start;
+    if (is_block_marked(w->visited_twice, index)) {
+        return false;
+    }
+    if (is_block_marked(w->visited, index)) {
+        mark_block(w->visited_twice, index); // Already in visited_list
+        return true;
+    }
+    if (w->visited_count == w->visited_cap) {
+        size_t cap = w->visited_cap ? w->visited_cap * 2 : 64;
+        uint32_t *grown = realloc(w->visited_list, cap * sizeof(uint32_t));
+        if (grown == NULL) {
+            w->out_of_memory = true;
+            return false;
+        }
+        w->visited_list = grown;
+        w->visited_cap = cap;
+    }
+    mark_block(w->visited, index);
+    w->visited_list[w->visited_count++] = index;
+    return true;
+}
+
+// Loads an indirect block into stack slot depth, false if it cannot be read.
+// slot is where the parent frame read it ahead, -1 if it was not.
+bool push_indirect(walker_t *w, int depth, uint32_t block_num, int level, int inode_num, int slot) {
+    const uint32_t *pointers = NULL;
+    // A block changed by a fix not committed yet is read from its staged copy
+    if (slot >= 0 && !is_block_marked(fs->dirty_blocks, block_num)) {
+        readahead_t *ra = &w->ahead[depth - 1];
+        wait_readahead(w, depth - 1, slot);
+        if (ra->ok[slot]) {
+            pointers = ra->buf[slot];
+            count_read(BLOCK_SIZE);
+        }
+    }
+    if (pointers == NULL) {
+        pointers = get_block(block_num, w->pool[depth]);
+    }
+    if (pointers == NULL) {
+        add_finding(w, BAD_INDIRECT_READ, inode_num, block_num, level, 0);
+        return false;
+    }
+    walk_frame_t *f = &w->stack[depth];
+    f->block = block_num;
+    f->level = level;
+    f->next = 0;
+    f->pointers = pointers;
+    if (depth < MAX_INDIRECT_LEVEL - 1) {
+        w->ahead[depth].count = 0;
+        w->ahead[depth].head = 0;
+        w->ahead[depth].scan = 0;
+    }
+    return true;
+}
+
+// Queues the next window of child indirect blocks of the frame at depth, so
+// their reads are in flight together before the walk descends into the first
+// one. Blocks already walked twice for this inode or on the stack are left out.
+void queue_readahead(walker_t *w, int depth) {
+    walk_frame_t *f = &w->stack[depth];
+    readahead_t *ra = &w->ahead[depth];
+
+    // Buffers of the last window may still be in use by the kernel
+    drain_readahead(w, depth);
+
+    ra->count = 0;
+    ra->head = 0;
+    int i = ra->scan;
+    for (; i < (int)POINTERS_PER_BLOCK && ra->count < READAHEAD_WINDOW; i++) {
+        uint32_t p = f->pointers[i];
+        if (p < fs->data_block_start || p >= fs->total_blocks || p >= fs->image_blocks ||
+            is_block_marked(w->visited_twice, p - fs->data_block_start)) {
+            continue;
+        }
+        bool on_stack = false;
+        for (int d = 0; d <= depth; d++) {
+            on_stack = on_stack || w->stack[d].block == p;
+        }
+        if (!on_stack) {
+            ra->done[ra->count] = (fs->map != NULL); // Mapped blocks are only advised
+            ra->ok[ra->count] = false;
+            ra->block[ra->count++] = p;
+        }
+    }
+    ra->scan = i;
+
+    if (ra->count == 0) {
+        return;
+    }
+    if (fs->map != NULL) {
+        advise_blocks(ra->block, ra->count);
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (w->ring.fd != -1) {
+        for (int k = 0; k < ra->count; k++) {
+            uring_queue_read(&w->ring, ra->buf[k], ra->block[k], (uint64_t)depth * READAHEAD_WINDOW + k);
+        }
+        ra->in_flight = ra->count;
+        uring_reap(w, 0);
+        return;
+    }
+#endif
+    preadv_blocks(ra);
+}
+
+// Takes block_num off the head of the frame's window, returns its slot or -1
+// when it was not read ahead
+int pop_readahead(walker_t *w, int depth, uint32_t block_num) {
+    readahead_t *ra = &w->ahead[depth];
+    if (ra->head < ra->count && ra->block[ra->head] == block_num) {
+        return ra->head++;
+    }
+    return -1;
+}
+
+// Waits until a read-ahead slot has been filled
+void wait_readahead(walker_t *w, int depth, int slot) {
+#ifdef HAVE_IO_URING
+    while (!w->ahead[depth].done[slot] && w->ring.fd != -1) {
+        uring_reap(w, 1);
+    }
+#else
+    (void)w;
+    (void)depth;
+    (void)slot;
+#endif
+}
+
+// Waits for every read still in flight for the window at depth
+void drain_readahead(walker_t *w, int depth) {
+#ifdef HAVE_IO_URING
+    while (w->ahead[depth].in_flight > 0) {
+        uring_reap(w, 1);
+    }
+#else
+    (void)w;
+    (void)depth;
+#endif
+}
+
+// Mapped image: asks the kernel to start reading the blocks, runs of
+// consecutive blocks in one call
+void advise_blocks(const uint32_t *blocks, int count) {
+    for (int k = 0; k < count;) {
+        int run = 1;
+        while (k + run < count && blocks[k + run] == blocks[k] + run) {
+            run++;
+        }
+        size_t start = (size_t)blocks[k] * BLOCK_SIZE;
+        size_t end = start + (size_t)run * BLOCK_SIZE;
+        start -= start % page_size;
+        if (end > fs->map_size) {
+            end = fs->map_size;
+        }
+        if (start < end) {
+            madvise(fs->map + start, end - start, MADV_WILLNEED);
+        }
+        k += run;
+    }
+}
+
+// Fallback without io_uring: one preadv per run of consecutive blocks
+void preadv_blocks(readahead_t *ra) {
+    struct iovec iov[READAHEAD_WINDOW];
+    for (int k = 0; k < ra->count;) {
+        int run = 0;
+        do {
+            iov[run].iov_base = ra->buf[k + run];
+            iov[run].iov_len = BLOCK_SIZE;
+            run++;
+        } while (k + run < ra->count && ra->block[k + run] == ra->block[k] + run);
+
+        ssize_t got = preadv(fs->fd, iov, run, (off_t)ra->block[k] * BLOCK_SIZE);
+        for (int r = 0; r < run; r++) {
+            ra->done[k + r] = true;
+            ra->ok[k + r] = got >= (ssize_t)(r + 1) * BLOCK_SIZE;
+        }
+        k += run;
+    }
+}
+
+#ifdef HAVE_IO_URING
+// Sets up a ring with room for entries reads, leaves r->fd at -1 on failure
+bool uring_init(uring_t *r, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return false;
+    }
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        r->fd = fd;
+        uring_free(r);
+        return false;
+    }
+
+    uint8_t *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + params.sq_off.array);
+    r->cq_head = (unsigned *)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    r->fd = fd;
+    return true;
+}
+
+void uring_free(uring_t *r) {
+    if (r->fd == -1) {
+        return;
+    }
+    if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    if (r->cq_ring != NULL && r->cq_ring != MAP_FAILED) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    close(r->fd);
+    r->fd = -1;
+}
+
+// Fills in one read SQE, submitted by the next uring_reap()
+void uring_queue_read(uring_t *r, void *buffer, uint32_t block_num, uint64_t user_data) {
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fs->fd;
+    sqe->off = (uint64_t)block_num * BLOCK_SIZE;
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = BLOCK_SIZE;
+    sqe->user_data = user_data;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+}
+
+// Submits pending reads, waits for at least min_complete completions and
+// records every completion in its read-ahead slot. A failed or short read
+// leaves the slot not ok, the walk then reads the block itself.
+void uring_reap(walker_t *w, unsigned min_complete) {
+    uring_t *r = &w->ring;
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret = syscall(__NR_io_uring_enter, r->fd, r->pending, min_complete, flags, NULL, 0);
+    if (ret >= 0) {
+        r->pending -= (unsigned)ret < r->pending ? (unsigned)ret : r->pending;
+    } else if (errno != EINTR) {
+        uring_abandon(w);
+        return;
+    } else if (min_complete == 0) {
+        return;
+    }
+
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        readahead_t *ra = &w->ahead[cqe->user_data / READAHEAD_WINDOW];
+        int slot = cqe->user_data % READAHEAD_WINDOW;
+        ra->done[slot] = true;
+        ra->ok[slot] = cqe->res == BLOCK_SIZE;
+        ra->in_flight--;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// The ring failed and no completion can be waited for: every slot still
+// waiting is given up, so the walk reads those blocks with pread, and the
+// ring is closed, so later windows are read with preadv
+void uring_abandon(walker_t *w) {
+    for (int d = 0; d < MAX_INDIRECT_LEVEL - 1; d++) {
+        readahead_t *ra = &w->ahead[d];
+        for (int k = 0; k < ra->count; k++) {
+            if (!ra->done[k]) {
+                ra->done[k] = true;
+                ra->ok[k] = false;
+            }
+        }
+        ra->in_flight = 0;
+    }
+    w->ring.pending = 0;
+    uring_free(&w->ring);
+}
+#endif
+
+// Walks one indirect tree depth first with an explicit stack. Pointers back to
+// a block on the stack are cycles and are reported and cut. Any other indirect
+// block reached again is counted again and walked again, at most twice per
+// inode (see visit_indirect()), so the work per inode stays linear in the
+// blocks it reaches.
+void check_indirect_block(walker_t *w, uint32_t block_num, int level, int inode_num) {
+    if (!visit_indirect(w, block_num) || !push_indirect(w, 0, block_num, level, inode_num, -1)) {
+        return;
+    }
+
+    int depth = 1;
+    while (depth > 0) {
+        walk_frame_t *f = &w->stack[depth - 1];
+        if (f->next == (int)POINTERS_PER_BLOCK) {
+            depth--;
+            continue;
+        }
+
+        uint32_t p = f->pointers[f->next++];
+        if (p == 0) {
+            continue;
+        }
+        if (p < fs->data_block_start || p >= fs->total_blocks) {
+            add_finding(w, BAD_POINTER, inode_num, p, f->level, f->block);
+            continue;
+        }
+        if (f->level == 1) {
+            note_reference(w, p, inode_num);
+            continue;
+        }
+
+        // Read the next window of children once the walk reaches past the last one
+        readahead_t *ra = &w->ahead[depth - 1];
+        if (ra->head == ra->count && f->next > ra->scan) {
+            ra->scan = f->next - 1;
+            queue_readahead(w, depth - 1);
+        }
+        int slot = pop_readahead(w, depth - 1, p);
+
+        bool cycle = false;
+        for (int d = 0; d < depth; d++) {
+            cycle = cycle || w->stack[d].block == p;
+        }
+        if (cycle) {
+            add_finding(w, BAD_CYCLE, inode_num, p, f->level, f->block);
+            continue;
+        }
+
+        note_reference(w, p, inode_num);
+        if (visit_indirect(w, p) && push_indirect(w, depth, p, f->level - 1, inode_num, slot)) {
+            depth++;
+        }
+    }
+}
+
+// Walks the direct block and the three indirect trees of one inode
+void walk_inode(walker_t *w, int inode_num) {
+    const inode_t *inode = &fs->inode_table[inode_num];
+    if (!is_valid_inode(inode)) {
+        return;
+    }
+
+    // Check direct block
+    if (inode->direct_block != 0) {
+        if (inode->direct_block < fs->data_block_start || inode->direct_block >= fs->total_blocks) {
+            add_finding(w, BAD_DIRECT, inode_num, inode->direct_block, 0, 0);
+        } else {
+            note_reference(w, inode->direct_block, inode_num);
+        }
+    }
+
+    // Check single, double and triple indirect blocks
+    uint32_t roots[MAX_INDIRECT_LEVEL] = { inode->single_indirect, inode->double_indirect, inode->triple_indirect };
+    for (int level = 1; level <= MAX_INDIRECT_LEVEL; level++) {
+        uint32_t root = roots[level - 1];
+        if (root == 0) {
             continue;
         }
-        
-        // Check direct block
-        if (inode.direct_block != 0) {
-            if (inode.direct_block < DATA_BLOCK_START || inode.direct_block >= TOTAL_BLOCKS) {
-                printf("Error: Inode %d has invalid direct block %u (valid range: %u-%u)\n",
-                       i, inode.direct_block, DATA_BLOCK_START, TOTAL_BLOCKS-1);
-                bad_block_errors++;
-            } else {
-                used_blocks[inode.direct_block] = true;
+        if (root < fs->data_block_start || root >= fs->total_blocks) {
+            add_finding(w, BAD_INDIRECT_ROOT, inode_num, root, level, 0);
+        } else {
+            note_reference(w, root, inode_num);
+            check_indirect_block(w, root, level, inode_num);
+        }
+    }
+
+    // Forget this inode's visited blocks
+    for (size_t k = 0; k < w->visited_count; k++) {
+        w->visited[w->visited_list[k] / 64] = 0;
+        w->visited_twice[w->visited_list[k] / 64] = 0;
+    }
+    w->visited_count = 0;
+}
+
+// Thread body, walks one contiguous inode range of whole bitmap words. Only
+// outliers are walked inode by inode, every other valid inode just counts its
+// direct block, read from its column.
+void *walk_inode_range(void *arg) {
+    walker_t *w = arg;
+    fs = w->image;
+    if (w->first_inode >= w->end_inode) {
+        return NULL; // Past the last inode, its word belongs to the range before
+    }
+    for (size_t k = w->first_inode / 64; k < DIV_ROUND_UP((size_t)w->end_inode, 64); k++) {
+        for (uint64_t valid = fs->valid_inodes[k]; valid != 0; valid &= valid - 1) {
+            int i = (int)(k * 64 + __builtin_ctzll(valid));
+            if ((fs->outlier_inodes[k] >> (i % 64)) & 1) {
+                walk_inode(w, i);
+            } else if (fs->inode_columns.direct_block[i] != 0) {
+                note_reference(w, fs->inode_columns.direct_block[i], i);
             }
         }
-        
-        // Check single indirect block
-        if (inode.single_indirect != 0) {
-            if (inode.single_indirect < DATA_BLOCK_START || inode.single_indirect >= TOTAL_BLOCKS) {
-                printf("Error: Inode %d has invalid single indirect block %u\n",
-                       i, inode.single_indirect);
-                bad_block_errors++;
+    }
+    return NULL;
+}
+
+// Runs walkers[1..] on their own threads and walkers[0] on this one
+void run_walkers(walker_t *walkers, int threads) {
+    pthread_t tids[MAX_THREADS];
+    bool started[MAX_THREADS] = { false };
+
+    for (int t = 1; t < threads; t++) {
+        started[t] = (pthread_create(&tids[t], NULL, walk_inode_range, &walkers[t]) == 0);
+        if (!started[t]) {
+            walk_inode_range(&walkers[t]); // Could not start a thread, walk the range here
+        }
+    }
+    walk_inode_range(&walkers[0]);
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+}
+
+// Splits the inode table into one contiguous range per walker, each a whole
+// number of valid_inodes words
+int split_inode_ranges(walker_t *walkers, int threads) {
+    int per_thread = DIV_ROUND_UP(DIV_ROUND_UP((int)fs->inode_count, threads), 64) * 64;
+    for (int t = 0; t < threads; t++) {
+        walkers[t].image = fs;
+        walkers[t].first_inode = t * per_thread < (int)fs->inode_count ? t * per_thread : (int)fs->inode_count;
+        walkers[t].end_inode = (t + 1) * per_thread < (int)fs->inode_count ? (t + 1) * per_thread : (int)fs->inode_count;
+    }
+    return per_thread;
+}
+
+// Walks all inodes on fs->threads threads. Every thread lists the blocks it
+// references as extents, which are merged afterwards, so duplicates across
+// ranges are found without a shared lock. If any block ends
+// up referenced more than once, a second pass lists its owners.
+bool scan_block_references() {
+    // Ranges are whole valid_inodes words, more threads than words would idle
+    int threads = fs->threads;
+    int words = DIV_ROUND_UP((int)fs->inode_count, 64);
+    if (threads > words) {
+        threads = words > 0 ? words : 1;
+    }
+
+    walker_t *walkers = calloc(threads, sizeof(walker_t));
+    if (walkers == NULL) {
+        return false;
+    }
+    split_inode_ranges(walkers, threads);
+
+    // Fixes may have changed the table since the last pass
+    if (!build_valid_inode_map()) {
+        free(walkers);
+        return false;
+    }
+    if (check_only) {
+        prefetch_indirect_blocks();
+    }
+
+    bool ok = true;
+    for (int t = 0; t < threads; t++) {
+        ok = init_walker(&walkers[t]) && ok;
+    }
+    if (ok) {
+        run_walkers(walkers, threads);
+    }
+    for (int t = 0; t < threads; t++) {
+        ok = ok && !walkers[t].out_of_memory;
+    }
+    ok = ok && merge_references(walkers, threads);
+
+    // Merge in range order so findings stay in inode order
+    free(fs->bad_block_findings);
+    fs->bad_block_findings = walkers[0].findings;
+    fs->bad_block_finding_count = walkers[0].finding_count;
+    for (int t = 1; t < threads; t++) {
+        walker_t *w = &walkers[t];
+        if (ok && w->finding_count > 0) {
+            finding_t *grown = realloc(fs->bad_block_findings,
+                                       (fs->bad_block_finding_count + w->finding_count) * sizeof(finding_t));
+            if (grown == NULL) {
+                ok = false;
             } else {
-                used_blocks[inode.single_indirect] = true;
-                check_indirect_block(inode.single_indirect, 1, i);
+                fs->bad_block_findings = grown;
+                memcpy(fs->bad_block_findings + fs->bad_block_finding_count, w->findings,
+                       w->finding_count * sizeof(finding_t));
+                fs->bad_block_finding_count += w->finding_count;
             }
         }
-        
-        // Check double indirect block
-        if (inode.double_indirect != 0) {
-            if (inode.double_indirect < DATA_BLOCK_START || inode.double_indirect >= TOTAL_BLOCKS) {
-                printf("Error: Inode %d has invalid double indirect block %u\n",
-                       i, inode.double_indirect);
-                bad_block_errors++;
-            } else {
-                used_blocks[inode.double_indirect] = true;
-                check_indirect_block(inode.double_indirect, 2, i);
+        free(w->findings);
+    }
+    for (int t = 0; t < threads; t++) {
+        free_walker(&walkers[t]);
+    }
+    free(walkers);
+
+    return ok && collect_duplicate_owners(threads);
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Advises the blocks of sorted (block << 2 | level) entries, one call per run
+// of consecutive blocks
+void advise_runs(const uint64_t *entries, size_t count) {
+    for (size_t k = 0; k < count;) {
+        size_t run = 1;
+        while (k + run < count && (entries[k + run] >> 2) == (entries[k] >> 2) + run) {
+            run++;
+        }
+        posix_fadvise(fs->fd, (off_t)(entries[k] >> 2) * BLOCK_SIZE, (off_t)run * BLOCK_SIZE,
+                      POSIX_FADV_WILLNEED);
+        k += run;
+    }
+}
+
+// -n: pulls every indirect block into the page cache before the walk, so the
+// walk's reads, which follow each inode's tree, do not seek. Works one tree
+// level at a time: the level's blocks are sorted and advised, and the ones
+// whose pointers lead to more indirect blocks are read in block order, a run
+// of consecutive blocks per pread, to find the next level. Leaves that only
+// point at data blocks are advised and never read here. It is only a hint,
+// reads that fail are left for the walk to report.
+void prefetch_indirect_blocks() {
+    uint64_t *seen = calloc(fs->block_map_words, sizeof(uint64_t));
+    uint32_t (*buf)[POINTERS_PER_BLOCK] = malloc((size_t)PREFETCH_RUN * BLOCK_SIZE);
+    uint64_t *level = NULL;     // (block << 2 | indirection level) of the current tree level
+    size_t count = 0, cap = 0;
+    if (seen == NULL || buf == NULL) {
+        goto out;
+    }
+
+    // Roots of the inodes the walk will descend into
+    for (size_t k = 0; k < fs->inode_map_words; k++) {
+        for (uint64_t outliers = fs->outlier_inodes[k]; outliers != 0; outliers &= outliers - 1) {
+            size_t i = k * 64 + __builtin_ctzll(outliers);
+            for (int l = 0; l < MAX_INDIRECT_LEVEL; l++) {
+                uint32_t root = fs->inode_columns.roots[l][i];
+                if (root < fs->data_block_start || root >= fs->total_blocks || root >= fs->image_blocks ||
+                    is_block_marked(seen, root - fs->data_block_start)) {
+                    continue;
+                }
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 1024;
+                    uint64_t *grown = realloc(level, cap * sizeof(uint64_t));
+                    if (grown == NULL) {
+                        goto out;
+                    }
+                    level = grown;
+                }
+                mark_block(seen, root - fs->data_block_start);
+                level[count++] = (uint64_t)root << 2 | (l + 1);
             }
         }
-        
-        // Check triple indirect block
-        if (inode.triple_indirect != 0) {
-            if (inode.triple_indirect < DATA_BLOCK_START || inode.triple_indirect >= TOTAL_BLOCKS) {
-                printf("Error: Inode %d has invalid triple indirect block %u\n",
-                       i, inode.triple_indirect);
-                bad_block_errors++;
+    }
+
+    while (count > 0) {
+        qsort(level, count, sizeof(uint64_t), compare_u64);
+        advise_runs(level, count);
+
+        // The children of this level's non-leaf blocks make up the next level
+        uint64_t *next = NULL;
+        size_t next_count = 0, next_cap = 0;
+        for (size_t k = 0; k < count;) {
+            if ((level[k] & 3) == 1) {
+                k++;
+                continue;
+            }
+            uint32_t first = (uint32_t)(level[k] >> 2);
+            size_t run = 1;
+            while (k + run < count && run < PREFETCH_RUN && (level[k + run] >> 2) == first + run &&
+                   (level[k + run] & 3) > 1) {
+                run++;
+            }
+            uint32_t got = pread_blocks(buf, first, (uint32_t)run);
+            for (uint32_t r = 0; r < got; r++) {
+                int child_level = (int)(level[k + r] & 3) - 1;
+                for (size_t j = 0; j < POINTERS_PER_BLOCK; j++) {
+                    uint32_t p = buf[r][j];
+                    if (p < fs->data_block_start || p >= fs->total_blocks || p >= fs->image_blocks ||
+                        is_block_marked(seen, p - fs->data_block_start)) {
+                        continue;
+                    }
+                    if (next_count == next_cap) {
+                        next_cap = next_cap ? next_cap * 2 : 1024;
+                        uint64_t *grown = realloc(next, next_cap * sizeof(uint64_t));
+                        if (grown == NULL) {
+                            free(next);
+                            goto out;
+                        }
+                        next = grown;
+                    }
+                    mark_block(seen, p - fs->data_block_start);
+                    next[next_count++] = (uint64_t)p << 2 | child_level;
+                }
+            }
+            k += run;
+        }
+        free(level);
+        level = next;
+        count = next_count;
+    }
+
+out:
+    free(level);
+    free(buf);
+    free(seen);
+}
+
+int compare_owners(const void *a, const void *b) {
+    const block_owner_t *x = a, *y = b;
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    return (x->inode > y->inode) - (x->inode < y->inode);
+}
+
+// Second pass, only when something is duplicated: lists every reference to a
+// block in a duplicate extent, so memory grows with the duplicates only
+bool collect_duplicate_owners(int threads) {
+    free(fs->dup_owners);
+    fs->dup_owners = NULL;
+    fs->dup_owner_count = 0;
+
+    if (fs->dup_count == 0) {
+        return true;
+    }
+
+    walker_t *walkers = calloc(threads, sizeof(walker_t));
+    if (walkers == NULL) {
+        return false;
+    }
+    split_inode_ranges(walkers, threads);
+    bool ok = true;
+    for (int t = 0; t < threads; t++) {
+        walkers[t].collect_owners = true;
+        ok = init_walker(&walkers[t]) && ok;
+    }
+    if (ok) {
+        run_walkers(walkers, threads);
+    }
+
+    for (int t = 0; t < threads; t++) {
+        walker_t *w = &walkers[t];
+        ok = ok && !w->out_of_memory;
+        if (ok && w->owner_count > 0) {
+            block_owner_t *grown = realloc(fs->dup_owners, (fs->dup_owner_count + w->owner_count) * sizeof(block_owner_t));
+            if (grown == NULL) {
+                ok = false;
             } else {
-                used_blocks[inode.triple_indirect] = true;
-                check_indirect_block(inode.triple_indirect, 3, i);
+                fs->dup_owners = grown;
+                memcpy(fs->dup_owners + fs->dup_owner_count, w->owners, w->owner_count * sizeof(block_owner_t));
+                fs->dup_owner_count += w->owner_count;
             }
         }
+        free(w->owners);
+        free_walker(w);
+    }
+    free(walkers);
+
+    qsort(fs->dup_owners, fs->dup_owner_count, sizeof(block_owner_t), compare_owners);
+    return ok;
+}
+
+// Index of the first owner of a duplicated block, count gets the number of references
+size_t find_owners(uint32_t block_num, size_t *count) {
+    size_t lo = 0, hi = fs->dup_owner_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (fs->dup_owners[mid].block < block_num) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t end = lo;
+    while (end < fs->dup_owner_count && fs->dup_owners[end].block == block_num) {
+        end++;
+    }
+    *count = end - lo;
+    return lo;
+}
+
+//Reports blocks outside valid range found by the block walk
+bool check_bad_blocks() {
+    fs->bad_block_errors = 0;
+    
+    for (size_t k = 0; k < fs->bad_block_finding_count; k++) {
+        report_finding(&fs->bad_block_findings[k]);
+        fs->bad_block_errors++;
     }
     
-    if (bad_block_errors > 0) {
-        printf("Bad blocks check: FAILED (%d bad blocks found)\n", bad_block_errors);
+    if (fs->bad_block_errors > 0) {
+        say("Bad blocks check: FAILED (%d bad blocks found)\n", fs->bad_block_errors);
         return false;
     } else {
-        printf("Bad blocks check: PASSED\n");
+        say("Bad blocks check: PASSED\n");
         return true;
     }
 }
 
 void print_fsck_results() {
+    if (fs->format != FORMAT_TEXT) {
+        int counts[] = { fs->superblock_errors, fs->inode_bitmap_errors, fs->data_bitmap_errors,
+                         fs->duplicate_block_errors, fs->bad_block_errors };
+        for (int k = 0; k < 5; k++) {
+            report_record_t r = { .type = REC_COUNT, .kind = k, .pass = fs->report_pass, .v = { counts[k] } };
+            emit_record(&r);
+        }
+        return;
+    }
+
     printf("\nFSCK Results Summary:\n");
     printf("--------------------\n");
-    printf("Superblock errors: %d\n", superblock_errors);
-    printf("Inode bitmap errors: %d\n", inode_bitmap_errors);
-    printf("Data bitmap errors: %d\n", data_bitmap_errors);
-    printf("Duplicate block errors: %d\n", duplicate_block_errors);
-    printf("Bad block errors: %d\n", bad_block_errors);
-    int total_errors = superblock_errors + inode_bitmap_errors + data_bitmap_errors +
-                      duplicate_block_errors + bad_block_errors;
+    printf("Superblock errors: %d\n", fs->superblock_errors);
+    printf("Inode bitmap errors: %d\n", fs->inode_bitmap_errors);
+    printf("Data bitmap errors: %d\n", fs->data_bitmap_errors);
+    printf("Duplicate block errors: %d\n", fs->duplicate_block_errors);
+    printf("Bad block errors: %d\n", fs->bad_block_errors);
+    int total_errors = fs->superblock_errors + fs->inode_bitmap_errors + fs->data_bitmap_errors +
+                      fs->duplicate_block_errors + fs->bad_block_errors;
     if (total_errors == 0) {
         printf("\nFSCK completed successfully. File system is consistent.\n");
     } else {
@@ -563,231 +3288,350 @@ void print_fsck_results() {
     }
 }
 
-void fix_block_reference(uint32_t *block_ptr, int inode_num, const char *block_type) {
+bool fix_block_reference(uint32_t *block_ptr, int inode_num, const char *block_type) {
     
-    if (*block_ptr != 0 && (*block_ptr < DATA_BLOCK_START || *block_ptr >= TOTAL_BLOCKS)) {
-        printf("Fixed bad block: Inode %d, %s block %u (invalid range)\n", inode_num, block_type, *block_ptr);
+    if (*block_ptr != 0 && (*block_ptr < fs->data_block_start || *block_ptr >= fs->total_blocks)) {
+        say("Fixed bad block: Inode %d, %s block %u (invalid range)\n", inode_num, block_type, *block_ptr);
         *block_ptr = 0; // Clear the invalid reference
+        return true;
+    }
+    return false;
+}
+
+// Fix all block pointers, returns true if the inode changed
+bool fix_all_inode_blocks(inode_t *inode, int inode_num) {
+    bool changed = false;
+    changed |= fix_block_reference(&inode->direct_block, inode_num, "direct");
+    changed |= fix_block_reference(&inode->single_indirect, inode_num, "single indirect");
+    changed |= fix_block_reference(&inode->double_indirect, inode_num, "double indirect");
+    changed |= fix_block_reference(&inode->triple_indirect, inode_num, "triple indirect");
+    return changed;
+}
+
+
+// Returns the block a pointer should hold: the first reference to a duplicated
+// block claims it, every later one gets a copy of it in a newly allocated block
+uint32_t claim_or_copy(uint64_t *claimed, uint32_t block_num, int inode_num, const char *block_type) {
+    if (!in_extents(fs->dup_extents, fs->dup_count, block_num)) {
+        return block_num;
+    }
+    if (!is_block_marked(claimed, block_num)) {
+        mark_block(claimed, block_num);
+        return block_num;
+    }
+    return copy_block(block_num, inode_num, block_type);
+}
+
+// Copies a block into a newly allocated one and returns it, or block_num if
+// there is no free block or the copy failed
+uint32_t copy_block(uint32_t block_num, int inode_num, const char *block_type) {
+    // Allocate a new block for this inode
+    int new_block = allocate_new_data_block();
+    if (new_block == -1) {
+        notice("No free block to fix duplicate: Inode %d, %s block %u\n", inode_num, block_type, block_num);
+        return block_num;
+    }
+
+    // Copy data from old block to new block
+    uint8_t buffer[BLOCK_SIZE];
+    if (!read_block(block_num, buffer) || !write_block(new_block, buffer)) {
+        notice("Error copying duplicate block %u\n", block_num);
+        return block_num;
+    }
+    say("Fixed duplicate: Inode %d, %s block %u (*). %d\n", inode_num, block_type, block_num, new_block);
+    return new_block;
+}
+
+// Fixes one pointer to a block of the given level (0 = data block), true if
+// it now points at a copy. Everything below a copy is shared with the
+// original, so it is copied too. A block claimed earlier that could not be
+// copied was fixed below when it was claimed and is not walked again, so the
+// work is bounded by the blocks claimed and copied.
+bool fix_duplicate_pointer(uint64_t *claimed, uint32_t *block_ptr, int level, int inode_num, const char *block_type) {
+    uint32_t p = *block_ptr;
+    bool walked = is_block_marked(claimed, p);
+    uint32_t fixed = claim_or_copy(claimed, p, inode_num, block_type);
+    if (fixed != p) {
+        *block_ptr = fixed;
+        if (level > 0) {
+            copy_duplicate_tree(fixed, level, inode_num);
+        }
+        return true;
+    }
+    if (level > 0 && !walked) {
+        fix_duplicate_tree(claimed, p, level, inode_num);
+    }
+    return false;
+}
+
+// Fixes duplicates below one of the inode's own indirect blocks
+void fix_duplicate_tree(uint64_t *claimed, uint32_t block_num, int level, int inode_num) {
+    uint32_t block_pointers[BLOCK_SIZE / sizeof(uint32_t)];
+    if (!read_block(block_num, block_pointers)) {
+        return;
+    }
+
+    char block_type[32];
+    snprintf(block_type, sizeof(block_type), "level-%d entry", level);
+
+    bool changed = false;
+    int num_pointers = BLOCK_SIZE / sizeof(uint32_t);
+    for (int i = 0; i < num_pointers; i++) {
+        uint32_t p = block_pointers[i];
+        if (p < fs->data_block_start || p >= fs->total_blocks) {
+            continue;
+        }
+        changed |= fix_duplicate_pointer(claimed, &block_pointers[i], level - 1, inode_num, block_type);
+    }
+
+    if (changed && !write_block(block_num, block_pointers)) {
+        notice("Error writing indirect block %u\n", block_num);
+    }
+}
+
+// Gives a copied indirect block copies of everything below it, so the copy
+// shares nothing with the original
+void copy_duplicate_tree(uint32_t block_num, int level, int inode_num) {
+    uint32_t block_pointers[BLOCK_SIZE / sizeof(uint32_t)];
+    fs->tree_copied = true;
+    if (!read_block(block_num, block_pointers)) {
+        return;
+    }
+
+    char block_type[32];
+    snprintf(block_type, sizeof(block_type), "level-%d entry", level);
+
+    bool changed = false;
+    int num_pointers = BLOCK_SIZE / sizeof(uint32_t);
+    for (int i = 0; i < num_pointers; i++) {
+        uint32_t p = block_pointers[i];
+        if (p < fs->data_block_start || p >= fs->total_blocks) {
+            continue;
+        }
+        uint32_t copy = copy_block(p, inode_num, block_type);
+        if (copy == p) {
+            continue; // No room, the rest stays shared
+        }
+        block_pointers[i] = copy;
+        changed = true;
+        if (level > 1) {
+            copy_duplicate_tree(copy, level - 1, inode_num);
+        }
+    }
+
+    if (changed && !write_block(block_num, block_pointers)) {
+        notice("Error writing indirect block %u\n", block_num);
+    }
+}
+
+// Clears the pointers in an indirect block that lead back to its ancestor
+void cut_cycle(const finding_t *f) {
+    uint32_t block_pointers[POINTERS_PER_BLOCK];
+    if (!read_block(f->parent, block_pointers)) {
+        return;
+    }
+    for (size_t i = 0; i < POINTERS_PER_BLOCK; i++) {
+        if (block_pointers[i] == f->block) {
+            block_pointers[i] = 0;
+        }
+    }
+    if (!write_block(f->parent, block_pointers)) {
+        notice("Error writing indirect block %u\n", f->parent);
+        return;
+    }
+    say("Fixed cycle: Inode %d, level-%d indirect block %u no longer points to %u\n",
+           f->inode, f->level, f->parent, f->block);
+}
+
+// Clears an out of range pointer inside an indirect block
+void clear_bad_pointer(const finding_t *f) {
+    uint32_t block_pointers[POINTERS_PER_BLOCK];
+    if (!read_block(f->parent, block_pointers)) {
+        return;
+    }
+    bool changed = false;
+    for (size_t i = 0; i < POINTERS_PER_BLOCK; i++) {
+        if (block_pointers[i] == f->block) {
+            block_pointers[i] = 0;
+            changed = true;
+        }
+    }
+    if (!changed) {
+        return; // Another finding in the same block cleared it already
+    }
+    if (!write_block(f->parent, block_pointers)) {
+        notice("Error writing indirect block %u\n", f->parent);
+        return;
     }
+    say("Fixed bad block: Inode %d, level-%d indirect block %u pointer %u (invalid range)\n",
+        f->inode, f->level, f->parent, f->block);
 }
 
-// Fix all block pointers 
-void fix_all_inode_blocks(inode_t *inode, int inode_num) {
-    fix_block_reference(&inode->direct_block, inode_num, "direct");
-    fix_block_reference(&inode->single_indirect, inode_num, "single indirect");
-    fix_block_reference(&inode->double_indirect, inode_num, "double indirect");
-    fix_block_reference(&inode->triple_indirect, inode_num, "triple indirect");
+// Gives each owner of a duplicated block its own copy, at every level. Owners
+// are walked in inode order, so the lowest numbered inode keeps the original.
+bool fix_duplicates() {
+    uint64_t *claimed = calloc(DIV_ROUND_UP((size_t)fs->total_blocks, 64), sizeof(uint64_t));
+    int *owner_inodes = malloc(fs->dup_owner_count * sizeof(int) + 1);
+    if (claimed == NULL || owner_inodes == NULL) {
+        free(claimed);
+        free(owner_inodes);
+        return false;
+    }
+
+    // Distinct owning inodes, ascending
+    size_t n = 0;
+    for (size_t k = 0; k < fs->dup_owner_count; k++) {
+        owner_inodes[n++] = fs->dup_owners[k].inode;
+    }
+    qsort(owner_inodes, n, sizeof(int), compare_ints);
+
+    static const char *root_types[] = { "direct", "single indirect", "double indirect", "triple indirect" };
+    for (size_t k = 0; k < n; k++) {
+        int i = owner_inodes[k];
+        if (k > 0 && owner_inodes[k - 1] == i) {
+            continue;
+        }
+        inode_t *inode = &fs->inode_table[i];
+        uint32_t *roots[4] = { &inode->direct_block, &inode->single_indirect,
+                               &inode->double_indirect, &inode->triple_indirect };
+
+        for (int level = 0; level <= 3; level++) {
+            uint32_t p = *roots[level];
+            if (p < fs->data_block_start || p >= fs->total_blocks) {
+                continue;
+            }
+            if (fix_duplicate_pointer(claimed, roots[level], level, i, root_types[level])) {
+                // Modified inode, written back with the rest of the table
+                mark_inode_dirty(i);
+            }
+        }
+    }
+
+    free(claimed);
+    free(owner_inodes);
+    return true;
 }
 
+int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
 
 void fix_errors() {
+    fs->alloc_hint = 0;
+
     // Fix superblock if needed
-    if (superblock_errors > 0) {
-        printf("Fixing superblock...\n");
-        superblock.magic = VSFS_MAGIC;
-        superblock.block_size = BLOCK_SIZE;
-        superblock.total_blocks = TOTAL_BLOCKS;
-        superblock.inode_bitmap_block = INODE_BITMAP_BLOCK_NUM;
-        superblock.data_bitmap_block = DATA_BITMAP_BLOCK_NUM;
-        superblock.inode_table_block = INODE_TABLE_START_BLOCK;
-        superblock.data_block_start = DATA_BLOCK_START;
-        superblock.inode_size = INODE_SIZE;
-        superblock.inode_count = INODE_COUNT;
+    if (fs->superblock_errors > 0) {
+        say("Fixing superblock...\n");
+        fs->superblock->magic = VSFS_MAGIC;
+        fs->superblock->block_size = BLOCK_SIZE;
+        fs->superblock->total_blocks = fs->total_blocks;
+        fs->superblock->inode_bitmap_block = fs->inode_bitmap_block;
+        fs->superblock->data_bitmap_block = fs->data_bitmap_block;
+        fs->superblock->inode_table_block = fs->inode_table_block;
+        fs->superblock->data_block_start = fs->data_block_start;
+        fs->superblock->inode_size = INODE_SIZE;
+        fs->superblock->inode_count = fs->inode_count;
         
-        if (!write_block(SUPERBLOCK_BLOCK_NUM, &superblock)) {
-            printf("Error writing superblock\n");
-        }
+        mark_block_dirty(SUPERBLOCK_BLOCK_NUM);
     }
     
     // Fix inode bitmap if needed
-    if (inode_bitmap_errors > 0) {
-        printf("Fixing inode bitmap...\n");
+    if (fs->inode_bitmap_errors > 0) {
+        say("Fixing inode bitmap...\n");
         
         // Reset inode bitmap
-        memset(inode_bitmap, 0, BLOCK_SIZE);
+        memset(fs->inode_bitmap, 0, (size_t)(fs->data_bitmap_block - fs->inode_bitmap_block) * BLOCK_SIZE);
         
         // Mark inodes as used based on their validity
-        for (int i = 0; i < INODE_COUNT; i++) {
-            inode_t inode;
-            int block_num = INODE_TABLE_START_BLOCK + (i * INODE_SIZE) / BLOCK_SIZE;
-            int offset = (i * INODE_SIZE) % BLOCK_SIZE;
-            
-            uint8_t block[BLOCK_SIZE];
-            if (!read_block(block_num, block)) {
-                printf("Error reading inode table block %d\n", block_num);
-                continue;
-            }
-            
-            memcpy(&inode, block + offset, sizeof(inode_t));
-            
-            // Mark valid inodes as used in the bitmap
-            if (is_valid_inode(&inode)) {
-                set_bit(inode_bitmap, i);
-            }
-        }
+        build_valid_inode_map();
+        store_bitmap_words(fs->inode_bitmap, fs->valid_inodes, fs->valid_inodes, fs->inode_count);
         
-        // Write updated inode bitmap
-        if (!write_block(INODE_BITMAP_BLOCK_NUM, inode_bitmap)) {
-            printf("Error writing inode bitmap\n");
-        }
+        // Updated inode bitmap
+        mark_range_dirty(fs->inode_bitmap_block, fs->data_bitmap_block);
     }
     
     // Fix data bitmap if needed
-    if (data_bitmap_errors > 0) {
-        printf("Fixing data bitmap...\n");
-        
-        // Reset data bitmap
-        memset(data_bitmap, 0, BLOCK_SIZE);
+    if (fs->data_bitmap_errors > 0) {
+        say("Fixing data bitmap...\n");
         
-        // Mark blocks as used based on valid inodes
-        for (int i = DATA_BLOCK_START; i < TOTAL_BLOCKS; i++) {
-            if (used_blocks[i]) {
-                set_bit(data_bitmap, i - DATA_BLOCK_START);
-            }
-        }
+        rebuild_data_bitmap();
         
-        // Write updated data bitmap
-        if (!write_block(DATA_BITMAP_BLOCK_NUM, data_bitmap)) {
-            printf("Error writing data bitmap\n");
-        }
+        // Updated data bitmap
+        mark_range_dirty(fs->data_bitmap_block, fs->inode_table_block);
     }
     
     
-    if (duplicate_block_errors > 0) {
-        printf("Fixing duplicate blocks...\n");
-        
-        // Creating a map to track which inode first used each block
-        int first_user_inode[TOTAL_BLOCKS];
-        memset(first_user_inode, -1, sizeof(first_user_inode));
-        
-        
-        for (int i = 0; i < INODE_COUNT; i++) {
-            inode_t inode;
-            int block_num = INODE_TABLE_START_BLOCK + (i * INODE_SIZE) / BLOCK_SIZE;
-            int offset = (i * INODE_SIZE) % BLOCK_SIZE;
-            
-            uint8_t block[BLOCK_SIZE];
-            if (!read_block(block_num, block)) {
-                continue;
-            }
-            
-            memcpy(&inode, block + offset, sizeof(inode_t));
-            
-            
-            if (!is_valid_inode(&inode)) {
-                continue;
-            }
-            
-            // Check direct block
-            if (inode.direct_block >= DATA_BLOCK_START && inode.direct_block < TOTAL_BLOCKS) {
-                if (first_user_inode[inode.direct_block] == -1) {
-                    first_user_inode[inode.direct_block] = i;
-                }
-            }
-            
+    if (fs->duplicate_block_errors > 0) {
+        say("Fixing duplicate blocks...\n");
         
+        if (!fix_duplicates()) {
+            notice("Out of memory fixing duplicate blocks\n");
         }
-        
-        // Now fix duplicates for each inode
-        for (int i = 0; i < INODE_COUNT; i++) {
-            inode_t inode;
-            int block_num = INODE_TABLE_START_BLOCK + (i * INODE_SIZE) / BLOCK_SIZE;
-            int offset = (i * INODE_SIZE) % BLOCK_SIZE;
-            
-            uint8_t inode_block[BLOCK_SIZE];
-            if (!read_block(block_num, inode_block)) {
-                continue;
-            }
-            
-            memcpy(&inode, inode_block + offset, sizeof(inode_t));
-            
-            // Skip invalid inodes
-            if (!is_valid_inode(&inode)) {
-                continue;
-            }
-            
-            bool inode_modified = false;
-            
-            // Fix direct block if it's duplicated
-            if (inode.direct_block >= DATA_BLOCK_START && inode.direct_block < TOTAL_BLOCKS) {
-                if (duplicated_blocks[inode.direct_block] && 
-                    first_user_inode[inode.direct_block] != i) {
-                    
-                    // Allocate a new block for this inode
-                    int new_block = allocate_new_data_block();
-                    if (new_block != -1) {
-                        // Copy data from old block to new block
-                        uint8_t buffer[BLOCK_SIZE];
-                        if (read_block(inode.direct_block, buffer) && 
-                            write_block(new_block, buffer)) {
-                            
-                            printf("Fixed duplicate: Inode %d, direct block %d (*). %d\n", 
-                                   i, inode.direct_block, new_block);
-                            
-                            // Update the inode
-                            inode.direct_block = new_block;
-                            inode_modified = true;
-                            
-                            // Mark the new block as used
-                            set_bit(data_bitmap, new_block - DATA_BLOCK_START);
-                            used_blocks[new_block] = true;
-                        }
-                    }
-                }
-            }
-            
-            // Modified inode
-            if (inode_modified) {
-                memcpy(inode_block + offset, &inode, sizeof(inode_t));
-                write_block(block_num, inode_block);
+
+        // A tree copied for a pointer of another level can leave blocks only
+        // the old tree reached, so the bitmap is built again from a new walk
+        if (fs->tree_copied) {
+            if (scan_block_references()) {
+                rebuild_data_bitmap();
+            } else {
+                notice("Out of memory walking block references\n");
             }
         }
-        
+
         // Updated data bitmap
-        if (!write_block(DATA_BITMAP_BLOCK_NUM, data_bitmap)) {
-            printf("Error writing data bitmap\n");
-        }
+        mark_range_dirty(fs->data_bitmap_block, fs->inode_table_block);
     }
     
     // Fix bad blocks
-    if (bad_block_errors > 0) {
-    printf("Fixing bad blocks...\n");
-    for (int i = 0; i < INODE_COUNT; i++) {
-        inode_t inode;
-        int block_num = INODE_TABLE_START_BLOCK + (i * INODE_SIZE) / BLOCK_SIZE;
-        int offset = (i * INODE_SIZE) % BLOCK_SIZE;
-        uint8_t inode_block[BLOCK_SIZE];
-        if (!read_block(block_num, inode_block)) {
-            continue;
+    if (fs->bad_block_errors > 0) {
+    say("Fixing bad blocks...\n");
+    for (size_t k = 0; k < fs->inode_map_words; k++) {
+        // Only outliers can have a bad direct or root pointer
+        for (uint64_t outliers = fs->outlier_inodes[k]; outliers != 0; outliers &= outliers - 1) {
+            int i = (int)(k * 64 + __builtin_ctzll(outliers));
+            if (fix_all_inode_blocks(&fs->inode_table[i], i)) {
+                mark_inode_dirty(i);
+            }
         }
-        memcpy(&inode, inode_block + offset, sizeof(inode_t));
-        if (!is_valid_inode(&inode)) {
-            continue;
+    }
+    for (size_t k = 0; k < fs->bad_block_finding_count; k++) {
+        if (fs->bad_block_findings[k].kind == BAD_CYCLE) {
+            cut_cycle(&fs->bad_block_findings[k]);
+        } else if (fs->bad_block_findings[k].kind == BAD_POINTER) {
+            clear_bad_pointer(&fs->bad_block_findings[k]);
         }
-
-        // Fix all block pointers 
-        fix_all_inode_blocks(&inode, i);
-        memcpy(inode_block + offset, &inode, sizeof(inode_t));
-        write_block(block_num, inode_block);
     }
 }
     //  updated data bitmap
-    if (data_bitmap_errors > 0 || duplicate_block_errors > 0 || bad_block_errors > 0) {
-        if (!write_block(DATA_BITMAP_BLOCK_NUM, data_bitmap)) {
-            printf("Error writing data bitmap\n");
-        }
+    if (fs->data_bitmap_errors > 0 || fs->duplicate_block_errors > 0 || fs->bad_block_errors > 0) {
+        mark_range_dirty(fs->data_bitmap_block, fs->inode_table_block);
+    }
+
+    // Write back everything that changed in one go
+    if (!commit_fs_image()) {
+        notice("Error committing fixes to %s\n", fs->path);
+    }
+}
+// Data bitmap with exactly the referenced blocks marked used
+void rebuild_data_bitmap() {
+    memset(fs->data_bitmap, 0, (size_t)(fs->inode_table_block - fs->data_bitmap_block) * BLOCK_SIZE);
+    for (size_t e = 0; e < fs->used_count; e++) {
+        set_bit_range(fs->data_bitmap, fs->used_extents[e].first - fs->data_block_start,
+                      fs->used_extents[e].end - fs->data_block_start);
     }
 }
+
 int allocate_new_data_block() {
-    for (int i = 0; i < TOTAL_BLOCKS - DATA_BLOCK_START; i++) {
-        if (!is_used_bit(data_bitmap, i)) {
+    for (uint32_t i = fs->alloc_hint; i < fs->total_blocks - fs->data_block_start; i++) {
+        // Free in the bitmap and not referenced by any inode
+        if (!is_used_bit(fs->data_bitmap, i) && !is_block_used(i + fs->data_block_start)) {
+            fs->alloc_hint = i + 1;
 
             // Free block found
-            int block_num = i + DATA_BLOCK_START;
-            set_bit(data_bitmap, i);
-            used_blocks[block_num] = true;
-            set_bit(data_bitmap, i);
-            used_blocks[block_num] = true;
+            int block_num = i + fs->data_block_start;
+            set_bit(fs->data_bitmap, i);
+            add_used_block(block_num);
             
             // Clear the block contents
             uint8_t zeros[BLOCK_SIZE] = {0};
@@ -796,5 +3640,6 @@ int allocate_new_data_block() {
             return block_num;
         }
     }
+    fs->alloc_hint = fs->total_blocks - fs->data_block_start; // Later calls fail at once
     return -1;  // Kono free block nei
 }
\ No newline at end of file